@@ -1,3 +1,5 @@
+// struct ucred for the server's peer check
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdio.h>
@@ -14,6 +16,35 @@
 
 #include <stdarg.h> // For variadic arguments
 
+// File change detection
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <time.h>
+
+// Event loop
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+// Background highlighting
+#include <pthread.h>
+
+// Crash recovery journal
+#include <fcntl.h>
+#include <sys/file.h>
+
+// Editor server
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Benchmark
+#include <sys/mman.h>
+
 void log_to_file(const char *format, ...) {
     FILE *log_file = fopen("debug.log", "a");
     if (!log_file) {
@@ -47,7 +78,7 @@ struct termios enableRawMode() {
 	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
 	raw.c_oflag &= ~(OPOST);
 	raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);   // Turn off echo, canonical mode, and signals
-	raw.c_cc[VMIN] = 1;                       // Minimum number of bytes for read
+	raw.c_cc[VMIN] = 0;                       // Reads return immediately, poll() does the waiting
 	raw.c_cc[VTIME] = 0;                      // No timeout for read
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
 		perror("tcsetattr");
@@ -70,23 +101,256 @@ void ob_init(OutBuffer* ob){
 	ob->size = 0;
 }
 
+// Make room for extra more bytes, so callers can write into buffer + size directly
+void ob_reserve(OutBuffer* ob, size_t extra){
+	if (ob->size + extra < ob->cap) return;
+
+	size_t new_cap = ob->cap * 2 + extra;
+	ob->buffer = realloc(ob->buffer, new_cap);
+	if (!ob->buffer) {
+		perror("realloc");
+		exit(1);
+	}
+	ob->cap = new_cap;
+}
+
 void ob_append(OutBuffer* ob, char* text, int text_size){
 	// int text_size = strlen(text);
 	if(ob->size + text_size >= ob->cap){
 		// Resize 
-		int new_cap = (ob->cap * 2) + text_size;
-		char* new_buff = malloc(sizeof(char) * new_cap);
-		memcpy(new_buff, ob->buffer, ob->size);
-		free(ob->buffer);
-		ob->buffer = new_buff;
-		ob->cap = new_cap;
-		
+		ob_reserve(ob, text_size);
 	}
 
 	memcpy(ob->buffer + ob->size, text, text_size);
 	ob->size += text_size;
 }
 
+// Output a non-blocking reader has not taken yet. Past OUT_QUEUE_MAX nothing more is
+// kept and the reader is marked overflowed: its screen can no longer be brought up to date
+#define OUT_QUEUE_MAX (16 << 20)
+typedef struct {
+	OutBuffer pending;
+	int overflow;
+} OutQueue;
+
+// Size the buffer for a whole frame up front: every cell as a 4 byte character plus
+// escape sequences per row. Frames then reuse it without growing
+void ob_fit_screen(OutBuffer* ob, int rows, int cols){
+	ob_reserve(ob, (size_t)rows * (cols * 4 + 64) + 256);
+}
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+// Writes v in decimal, left padded with spaces to width. Returns the length
+int fmt_uint(char* dst, unsigned int v, int width){
+	char tmp[10];
+	int n = 0;
+	while (v >= 100) {
+		const char* pair = digit_pairs + (v % 100) * 2;
+		tmp[n++] = pair[1];
+		tmp[n++] = pair[0];
+		v /= 100;
+	}
+	if (v >= 10) {
+		tmp[n++] = digit_pairs[v * 2 + 1];
+		tmp[n++] = digit_pairs[v * 2];
+	} else {
+		tmp[n++] = '0' + v;
+	}
+
+	int len = 0;
+	while (len + n < width) dst[len++] = ' ';
+	while (n > 0) dst[len++] = tmp[--n];
+	return len;
+}
+
+// Appends ESC [ row ; col H (1 based)
+void ob_append_cursor_move(OutBuffer* ob, int row, int col){
+	char seq[32];
+	int n = 0;
+	seq[n++] = '\033';
+	seq[n++] = '[';
+	n += fmt_uint(seq + n, row, 0);
+	seq[n++] = ';';
+	n += fmt_uint(seq + n, col, 0);
+	seq[n++] = 'H';
+	ob_append(ob, seq, n);
+}
+
+
+// Checks a word at a time whether any byte has its high bit set
+int bytes_are_ascii(const char* text, int size){
+	uint64_t acc = 0;
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, text + i, sizeof(word));
+		acc |= word;
+	}
+	for (; i < size; i++) acc |= (unsigned char)text[i];
+	return (acc & 0x8080808080808080ull) == 0;
+}
+
+int utf8_is_continuation(char c){
+	return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+// Decode one character. Malformed input is taken one byte at a time.
+int utf8_decode(const char* text, int size, uint32_t* codepoint){
+	unsigned char lead = text[0];
+	int len = lead < 0x80 ? 1 : lead < 0xc2 ? 0 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : lead < 0xf5 ? 4 : 0;
+	if (len == 1 || len == 0 || len > size) {
+		*codepoint = lead;
+		return 1;
+	}
+
+	uint32_t cp = lead & (0xff >> (len + 1));
+	for (int i = 1; i < len; i++) {
+		if (!utf8_is_continuation(text[i])) {
+			*codepoint = lead;
+			return 1;
+		}
+		cp = (cp << 6) | (text[i] & 0x3f);
+	}
+	*codepoint = cp;
+	return len;
+}
+
+typedef struct {
+	uint32_t first;
+	uint32_t last;
+} CodepointRange;
+
+static const CodepointRange zero_width_ranges[] = {
+	{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x0610, 0x061a },
+	{ 0x064b, 0x065f }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a }, { 0x1ab0, 0x1aff },
+	{ 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+	{ 0xfe20, 0xfe2f },
+};
+
+static const CodepointRange double_width_ranges[] = {
+	{ 0x1100, 0x115f }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff }, { 0x3400, 0x4dbf },
+	{ 0x4e00, 0x9fff }, { 0xa000, 0xa4cf }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff },
+	{ 0xfe30, 0xfe4f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x1f300, 0x1f64f },
+	{ 0x1f900, 0x1f9ff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+static int codepoint_in(const CodepointRange* ranges, int count, uint32_t cp){
+	int lo = 0;
+	int hi = count - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (cp < ranges[mid].first) hi = mid - 1;
+		else if (cp > ranges[mid].last) lo = mid + 1;
+		else return 1;
+	}
+	return 0;
+}
+
+int codepoint_width(uint32_t cp){
+	if (cp < 0x300) return 1;
+	if (codepoint_in(zero_width_ranges, sizeof(zero_width_ranges) / sizeof(zero_width_ranges[0]), cp)) return 0;
+	if (codepoint_in(double_width_ranges, sizeof(double_width_ranges) / sizeof(double_width_ranges[0]), cp)) return 2;
+	return 1;
+}
+
+
+
+// FNV-1a, used to tell which lines changed between two reads of a file
+// Continue a hash over more bytes, so a line read in pieces hashes like a whole one
+uint32_t hash_extend(uint32_t hash, const char* data, long size){
+	for (long i = 0; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t hash_bytes(const char* data, int size){
+	return hash_extend(2166136261u, data, size);
+}
+
+
+// Interned line text (--intern). Identical lines share one refcounted copy of their
+// bytes, looked up by hash. A gap buffer holding interned bytes has an empty gap at the
+// end and copies them out on its first edit, so only edited lines own their text.
+// Only used from the main thread.
+
+#define INTERN_MAX_BYTES (16 * 1024) // Longer lines are rarely repeated, and stay below LONG_LINE_BYTES
+#define INTERN_MIN_BUCKETS 4096
+
+typedef struct InternedText {
+	struct InternedText* next;  // Hash chain
+	uint32_t hash;
+	int refs;
+	int size;
+	char bytes[];
+} InternedText;
+
+int intern_lines = 0;
+InternedText** intern_table = NULL;
+size_t intern_buckets = 0;
+size_t intern_count = 0;
+
+void intern_rehash(size_t buckets){
+	InternedText** table = calloc(buckets, sizeof(InternedText*));
+	if (!table) {
+		perror("calloc");
+		exit(1);
+	}
+	for (size_t i = 0; i < intern_buckets; i++) {
+		InternedText* entry = intern_table[i];
+		while (entry) {
+			InternedText* next = entry->next;
+			entry->next = table[entry->hash & (buckets - 1)];
+			table[entry->hash & (buckets - 1)] = entry;
+			entry = next;
+		}
+	}
+	free(intern_table);
+	intern_table = table;
+	intern_buckets = buckets;
+}
+
+// Shared copy of text, with a reference taken for the caller
+InternedText* intern_get(const char* text, int size){
+	uint32_t hash = hash_bytes(text, size);
+	if (intern_buckets > 0) {
+		for (InternedText* entry = intern_table[hash & (intern_buckets - 1)]; entry; entry = entry->next) {
+			if (entry->hash == hash && entry->size == size && memcmp(entry->bytes, text, size) == 0) {
+				entry->refs++;
+				return entry;
+			}
+		}
+	}
+
+	if (intern_count >= intern_buckets) intern_rehash(intern_buckets ? intern_buckets * 2 : INTERN_MIN_BUCKETS);
+	InternedText* entry = malloc(sizeof(InternedText) + size);
+	if (!entry) {
+		perror("malloc");
+		exit(1);
+	}
+	entry->hash = hash;
+	entry->refs = 1;
+	entry->size = size;
+	memcpy(entry->bytes, text, size);
+	entry->next = intern_table[hash & (intern_buckets - 1)];
+	intern_table[hash & (intern_buckets - 1)] = entry;
+	intern_count++;
+	return entry;
+}
+
+void intern_release(InternedText* entry){
+	if (--entry->refs > 0) return;
+
+	InternedText** link = &intern_table[entry->hash & (intern_buckets - 1)];
+	while (*link != entry) link = &(*link)->next;
+	*link = entry->next;
+	intern_count--;
+	free(entry);
+}
+
 
 #define INIT_GAP_SIZE 5
 typedef struct {
@@ -95,11 +359,25 @@ typedef struct {
     int gap_end;            
 	size_t cap;
 	size_t logical_size; // Size of the text (excluding the gap)
+	struct WidthIndex* widths; // Only for lines of LONG_LINE_BYTES or more, see gb_widths
+	InternedText* shared;      // Owner of buffer while the text is interned and unedited
 } GapBuffer;
 
 
 
 int gb_init(GapBuffer* gb, char* text, int text_size){
+	gb->widths = NULL;
+	gb->shared = NULL;
+	if (intern_lines && text_size <= INTERN_MAX_BYTES) {
+		gb->shared = intern_get(text, text_size);
+		gb->buffer = gb->shared->bytes;
+		gb->gap_start = text_size;
+		gb->gap_end = text_size;
+		gb->cap = text_size;
+		gb->logical_size = text_size;
+		return 1;
+	}
+
 	int buffer_cap = text_size + INIT_GAP_SIZE;
 
 	gb->buffer = malloc(sizeof(char) * buffer_cap);
@@ -116,63 +394,382 @@ int gb_init(GapBuffer* gb, char* text, int text_size){
 	return 1;
 }
 
-void gb_move_gap(GapBuffer* gb, int pos){
-	
-	int move_gap_left = pos < gb->gap_start;
+char gb_char_at(GapBuffer* gb, int pos){
+	return pos < gb->gap_start ? gb->buffer[pos] : gb->buffer[pos + gb->gap_end - gb->gap_start];
+}
+
+// Copy size logical bytes starting at start into dst
+void gb_copy_range(GapBuffer* gb, int start, int size, char* dst){
+	if (start < gb->gap_start) {
+		int before = gb->gap_start - start < size ? gb->gap_start - start : size;
+		memcpy(dst, gb->buffer + start, before);
+		dst += before;
+		start += before;
+		size -= before;
+	}
+	if (size > 0) memcpy(dst, gb->buffer + start + (gb->gap_end - gb->gap_start), size);
+}
+
+// Give gb its own copy of interned text before it is edited
+void gb_unshare(GapBuffer* gb){
+	if (!gb->shared) return;
+
+	int cap = gb->logical_size + INIT_GAP_SIZE;
+	char* buffer = malloc(cap);
+	if (!buffer) {
+		perror("malloc");
+		exit(1);
+	}
+	gb_copy_range(gb, 0, gb->logical_size, buffer);
+	intern_release(gb->shared);
+	gb->shared = NULL;
+	gb->buffer = buffer;
+	gb->gap_start = gb->logical_size;
+	gb->gap_end = cap;
+	gb->cap = cap;
+}
+
+// Drop the text, whether owned or interned
+void gb_release_buffer(GapBuffer* gb){
+	if (gb->shared) intern_release(gb->shared);
+	else free(gb->buffer);
+	gb->shared = NULL;
+}
+
+// Lines at least this long keep a WidthIndex instead of a per-byte column map
+#define LONG_LINE_BYTES (64 * 1024)
+#define WIDTH_CHUNK 4096
+
+// Display widths of a giant line, summed per fixed-size chunk of the gap buffer's
+// storage. Bytes in the gap count as zero, so an edit only changes the chunks next
+// to the gap and no offsets have to shift. The chunk widths sit in a Fenwick tree,
+// which turns column <-> byte lookups into O(log n) plus a scan of one chunk.
+typedef struct WidthIndex {
+	int* tree;                  // Fenwick tree over widths, 1 based
+	int* widths;
+	int chunks;
+
+	// Layout the index matches. Code that sets a gap buffer's fields directly
+	// leaves these stale, and the index is rebuilt on its next use
+	char* buffer;
+	int gap_start;
+	int gap_end;
+} WidthIndex;
+
+void gb_widths_free(GapBuffer* gb){
+	if (!gb->widths) return;
+	free(gb->widths->tree);
+	free(gb->widths->widths);
+	free(gb->widths);
+	gb->widths = NULL;
+}
+
+int gb_widths_in_sync(GapBuffer* gb){
+	WidthIndex* wi = gb->widths;
+	return wi->buffer == gb->buffer && wi->gap_start == gb->gap_start && wi->gap_end == gb->gap_end;
+}
+
+int gb_physical(GapBuffer* gb, int pos){
+	return pos < gb->gap_start ? pos : pos + gb->gap_end - gb->gap_start;
+}
+
+int gb_logical(GapBuffer* gb, int phys){
+	return phys < gb->gap_start ? phys : phys - (gb->gap_end - gb->gap_start);
+}
+
+// Columns the byte at pos adds. A character's width is carried by its first byte and
+// malformed bytes take a column each, the same as line_col_map counts them
+int gb_byte_width(GapBuffer* gb, int pos){
+	char c = gb_char_at(gb, pos);
+	if ((unsigned char)c < 0x80) return 1;
+
+	char bytes[4];
+	uint32_t cp;
+	if (!utf8_is_continuation(c)) {
+		int size = gb->logical_size - pos < 4 ? gb->logical_size - pos : 4;
+		gb_copy_range(gb, pos, size, bytes);
+		utf8_decode(bytes, size, &cp);
+		return codepoint_width(cp);
+	}
 
-	if(move_gap_left){
-        while (gb->gap_start > pos) {
-			// Decrement gap pointers
-			gb->gap_start--;
-			gb->gap_end--;
+	// A continuation byte is free when the character before it spans it
+	for (int back = 1; back <= 3 && pos - back >= 0; back++) {
+		if (utf8_is_continuation(gb_char_at(gb, pos - back))) continue;
+		int start = pos - back;
+		int size = gb->logical_size - start < 4 ? gb->logical_size - start : 4;
+		gb_copy_range(gb, start, size, bytes);
+		return utf8_decode(bytes, size, &cp) > back ? 0 : 1;
+	}
+	return 1;
+}
 
-			// Move gap left 
-			gb->buffer[gb->gap_end] = gb->buffer[gb->gap_start];
+// Width of the bytes stored in physical [lo, hi), the gap excluded
+int gb_span_width(GapBuffer* gb, int lo, int hi){
+	int width = 0;
+	int runs[2][2] = {
+		{lo, hi < gb->gap_start ? hi : gb->gap_start},
+		{lo > gb->gap_end ? lo : gb->gap_end, hi},
+	};
+	for (int r = 0; r < 2; r++) {
+		int start = runs[r][0];
+		int end = runs[r][1];
+		if (start >= end) continue;
+		if (bytes_are_ascii(gb->buffer + start, end - start)) {
+			width += end - start;
+			continue;
 		}
-	} else {
-        while (gb->gap_start < pos) {
-			// Move gap right
-			gb->buffer[gb->gap_start] = gb->buffer[gb->gap_end];
 
-			// Increment gap pointers
-			gb->gap_start++;
-			gb->gap_end++;
+		// Continuation bytes at the start may belong to a character before the run
+		int p = start;
+		while (p < end && utf8_is_continuation(gb->buffer[p])) width += gb_byte_width(gb, gb_logical(gb, p++));
+
+		// Whole characters decoded in place, the last few bytes one at a time
+		while (p + 4 <= end) {
+			if ((unsigned char)gb->buffer[p] < 0x80) {
+				width++;
+				p++;
+				continue;
+			}
+			uint32_t cp;
+			p += utf8_decode(gb->buffer + p, 4, &cp);
+			width += codepoint_width(cp);
+		}
+		for (; p < end; p++) width += gb_byte_width(gb, gb_logical(gb, p));
+	}
+	return width;
+}
+
+int gb_chunk_width(GapBuffer* gb, int chunk){
+	int lo = chunk * WIDTH_CHUNK;
+	int hi = lo + WIDTH_CHUNK < (int)gb->cap ? lo + WIDTH_CHUNK : (int)gb->cap;
+	return gb_span_width(gb, lo, hi);
+}
+
+// Linear Fenwick build: every node passes its sum on to its parent
+void width_tree_build(int* tree, const int* widths, int chunks){
+	tree[0] = 0;
+	for (int i = 0; i < chunks; i++) tree[i + 1] = widths[i];
+	for (int i = 1; i <= chunks; i++) {
+		int parent = i + (i & -i);
+		if (parent <= chunks) tree[parent] += tree[i];
+	}
+}
+
+// Total width of the first count chunks
+int width_tree_sum(WidthIndex* wi, int count){
+	if (count > wi->chunks) count = wi->chunks;
+	int sum = 0;
+	for (int i = count; i > 0; i -= i & -i) sum += wi->tree[i];
+	return sum;
+}
+
+// The most leading chunks whose total width stays below col, and that total
+int width_tree_find(WidthIndex* wi, int col, int* total){
+	int count = 0;
+	int sum = 0;
+	int step = 1;
+	while (step * 2 <= wi->chunks) step *= 2;
+	for (; step > 0; step /= 2) {
+		if (count + step <= wi->chunks && sum + wi->tree[count + step] < col) {
+			count += step;
+			sum += wi->tree[count];
+		}
+	}
+	*total = sum;
+	return count;
+}
+
+// The index of gb, built or rebuilt if it does not match the buffer
+WidthIndex* gb_widths(GapBuffer* gb){
+	if (gb->widths && gb_widths_in_sync(gb)) return gb->widths;
+	gb_widths_free(gb);
+
+	WidthIndex* wi = malloc(sizeof(WidthIndex));
+	if (!wi) {
+		perror("malloc");
+		exit(1);
+	}
+	wi->chunks = (gb->cap + WIDTH_CHUNK - 1) / WIDTH_CHUNK;
+	wi->widths = malloc(sizeof(int) * (wi->chunks + 1));
+	wi->tree = malloc(sizeof(int) * (wi->chunks + 1));
+	if (!wi->widths || !wi->tree) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (int i = 0; i < wi->chunks; i++) wi->widths[i] = gb_chunk_width(gb, i);
+	width_tree_build(wi->tree, wi->widths, wi->chunks);
+
+	wi->buffer = gb->buffer;
+	wi->gap_start = gb->gap_start;
+	wi->gap_end = gb->gap_end;
+	gb->widths = wi;
+	return wi;
+}
+
+// Call before changing gb. Returns the index if it is worth patching afterwards
+WidthIndex* gb_widths_before_edit(GapBuffer* gb){
+	if (gb->widths && !gb_widths_in_sync(gb)) gb_widths_free(gb);
+	return gb->widths;
+}
+
+// Bytes in physical [lo, hi) changed. A byte's width depends on up to 3 neighbours on
+// either side, which can sit across the gap, so the chunks at both gap edges are redone too
+void gb_widths_touch(GapBuffer* gb, int lo, int hi){
+	WidthIndex* wi = gb->widths;
+	int ranges[3][2] = {
+		{lo - 3, hi + 3},
+		{gb->gap_start - 3, gb->gap_start},
+		{gb->gap_end, gb->gap_end + 3},
+	};
+	for (int r = 0; r < 3; r++) {
+		int first = ranges[r][0] > 0 ? ranges[r][0] / WIDTH_CHUNK : 0;
+		int last = (ranges[r][1] - 1) / WIDTH_CHUNK;
+		if (last >= wi->chunks) last = wi->chunks - 1;
+		for (int chunk = first; chunk <= last; chunk++) {
+			int delta = gb_chunk_width(gb, chunk) - wi->widths[chunk];
+			if (delta == 0) continue;
+			wi->widths[chunk] += delta;
+			for (int i = chunk + 1; i <= wi->chunks; i += i & -i) wi->tree[i] += delta;
+		}
+	}
+	wi->buffer = gb->buffer;
+	wi->gap_start = gb->gap_start;
+	wi->gap_end = gb->gap_end;
+}
+
+// Display column where the character holding pos starts
+int gb_col_of(GapBuffer* gb, int pos){
+	WidthIndex* wi = gb_widths(gb);
+	while (pos > 0 && pos < (int)gb->logical_size &&
+		   utf8_is_continuation(gb_char_at(gb, pos)) && gb_byte_width(gb, pos) == 0) {
+		pos--;
+	}
+
+	int phys = gb_physical(gb, pos);
+	int chunk = phys / WIDTH_CHUNK;
+	return width_tree_sum(wi, chunk) + gb_span_width(gb, chunk * WIDTH_CHUNK, phys);
+}
 
+// First character boundary at or after col
+int gb_pos_of_col(GapBuffer* gb, int col){
+	WidthIndex* wi = gb_widths(gb);
+	int width;
+	int chunk = width_tree_find(wi, col, &width);
 
+	for (int phys = chunk * WIDTH_CHUNK; phys < (int)gb->cap; phys++) {
+		if (phys >= gb->gap_start && phys < gb->gap_end) {
+			phys = gb->gap_end - 1;
+			continue;
 		}
+		int pos = gb_logical(gb, phys);
+		if (width >= col && !utf8_is_continuation(gb->buffer[phys])) return pos;
+		width += gb_byte_width(gb, pos);
+	}
+	return gb->logical_size;
+}
+
+
+void gb_move_gap(GapBuffer* gb, int pos){
+	if (pos == gb->gap_start) return;
+	gb_unshare(gb);
+	if (pos == gb->gap_start) return;
+	WidthIndex* widths = gb_widths_before_edit(gb);
+	int old_start = gb->gap_start;
+	int old_end = gb->gap_end;
+
+	if (pos < gb->gap_start) {
+		// Text between pos and the gap moves to just before its end
+		int count = gb->gap_start - pos;
+		memmove(gb->buffer + gb->gap_end - count, gb->buffer + pos, count);
+		gb->gap_start -= count;
+		gb->gap_end -= count;
+	} else {
+		// Text after the gap moves to its start
+		int count = pos - gb->gap_start;
+		memmove(gb->buffer + gb->gap_start, gb->buffer + gb->gap_end, count);
+		gb->gap_start += count;
+		gb->gap_end += count;
+	}
+
+	if (widths) {
+		gb_widths_touch(gb, old_start < gb->gap_start ? old_start : gb->gap_start,
+						old_start < gb->gap_start ? gb->gap_start : old_start);
+		gb_widths_touch(gb, old_end < gb->gap_end ? old_end : gb->gap_end,
+						old_end < gb->gap_end ? gb->gap_end : old_end);
 	}
+}
+
+// Double the buffer until the gap holds at least need bytes
+void gb_grow(GapBuffer* gb, int need){
+	gb_unshare(gb);
+	WidthIndex* widths = gb_widths_before_edit(gb);
+	int old_cap = gb->cap;
+	int new_cap = gb->cap;
+	while (new_cap - (int)gb->logical_size < need) new_cap *= 2;
+
+	// With an index, shift the text after the gap by whole chunks so their widths carry over
+	if (widths) new_cap += (WIDTH_CHUNK - (new_cap - old_cap) % WIDTH_CHUNK) % WIDTH_CHUNK;
+
+	char* new_buffer = malloc(sizeof(char) * new_cap);
+	if (!new_buffer) {
+		perror("malloc");
+		exit(1);
+	}
+
+	// Move text before gap
+	memcpy(new_buffer, gb->buffer, gb->gap_start);
+
+	int text_after_gap_size = gb->cap - gb->gap_end;
+	int new_gap_end = new_cap - text_after_gap_size;
 
+	// Move text after gap
+	memcpy(new_buffer + new_gap_end, gb->buffer + gb->gap_end, text_after_gap_size);
+
+	free(gb->buffer);
+	gb->buffer = new_buffer;
+	gb->cap = new_cap;
+	gb->gap_end = new_gap_end;
+	if (!widths) return;
+
+	int shift = (new_cap - old_cap) / WIDTH_CHUNK;
+	int chunks = (new_cap + WIDTH_CHUNK - 1) / WIDTH_CHUNK;
+	int* new_widths = malloc(sizeof(int) * (chunks + 1));
+	int* tree = malloc(sizeof(int) * (chunks + 1));
+	if (!new_widths || !tree) {
+		perror("malloc");
+		exit(1);
+	}
+	for (int i = 0; i < chunks; i++) {
+		if ((i + 1) * WIDTH_CHUNK <= gb->gap_start) new_widths[i] = widths->widths[i];
+		else if (i * WIDTH_CHUNK >= gb->gap_end) new_widths[i] = widths->widths[i - shift];
+		else new_widths[i] = gb_chunk_width(gb, i);
+	}
+
+	width_tree_build(tree, new_widths, chunks);
+	free(widths->widths);
+	free(widths->tree);
+	widths->widths = new_widths;
+	widths->tree = tree;
+	widths->chunks = chunks;
+	widths->buffer = gb->buffer;
+	widths->gap_start = gb->gap_start;
+	widths->gap_end = gb->gap_end;
 }
 
 int gb_insert(GapBuffer* gb, int pos, char c){
 	if (pos < 0 || pos > gb->logical_size) return 0;
+	gb_unshare(gb);
     gb_move_gap(gb, pos);
 	
 	// Resize gap
-	if(gb->gap_start == gb->gap_end){
-		int new_cap = gb->cap * 2;
-		char* new_buffer = malloc(sizeof(char)*new_cap);
-
-
-		// Move text before gap 
-		memcpy(new_buffer, gb->buffer, gb->gap_start);
-		
-		int text_after_gap_size = gb->cap - gb->gap_end;
-		int new_gap_end = new_cap - text_after_gap_size;
-
-		// Move text after gap 
-		memcpy(new_buffer + new_gap_end, gb->buffer + gb->gap_end, text_after_gap_size);
-		
-		// Update
-		free(gb->buffer);
-		gb->cap = new_cap;
-		gb->gap_end = new_gap_end;
-		gb->buffer = new_buffer;
-	}
+	if(gb->gap_start == gb->gap_end) gb_grow(gb, 1);
 
     // Insert the character and move gap start
+	WidthIndex* widths = gb_widths_before_edit(gb);
     gb->buffer[gb->gap_start++] = c;
 	gb->logical_size++;
+	if (widths) gb_widths_touch(gb, gb->gap_start - 1, gb->gap_start);
 
 	return 1;
 }
@@ -181,55 +778,60 @@ int gb_insert(GapBuffer* gb, int pos, char c){
 
 int gb_insert_chunk(GapBuffer* gb, int pos, const char* text, int text_size) {
     if (pos < 0 || pos > gb->logical_size) return 0;
+	gb_unshare(gb);
     gb_move_gap(gb, pos);
 
     // Resize gap if necessary
-    while (gb->gap_start + text_size > gb->gap_end) {
-        int new_cap = gb->cap * 2;
-        char* new_buffer = malloc(sizeof(char) * new_cap);
-
-        // Move text before gap
-        memcpy(new_buffer, gb->buffer, gb->gap_start);
-
-        int text_after_gap_size = gb->cap - gb->gap_end;
-        int new_gap_end = new_cap - text_after_gap_size;
-
-        // Move text after gap
-        memcpy(new_buffer + new_gap_end, gb->buffer + gb->gap_end, text_after_gap_size);
-
-        free(gb->buffer);
-        gb->buffer = new_buffer;
-        gb->cap = new_cap;
-        gb->gap_end = new_gap_end;
-    }
+    if (gb->gap_start + text_size > gb->gap_end) gb_grow(gb, text_size);
 
     // Insert the chunk
+	WidthIndex* widths = gb_widths_before_edit(gb);
     memcpy(gb->buffer + gb->gap_start, text, text_size);
     gb->gap_start += text_size;
     gb->logical_size += text_size;
+	if (widths) gb_widths_touch(gb, gb->gap_start - text_size, gb->gap_start);
 
     return 1;
 }
 
+// Deletes the byte before pos
 int gb_delete(GapBuffer* gb, int pos){
 
-	if (pos < 0 || pos >= gb->logical_size) return 0;
-
+	if (pos <= 0 || pos > gb->logical_size) return 0;
 
+	gb_unshare(gb);
     gb_move_gap(gb, pos);
 
     // Delete the character by expanding the gap backward
     if (gb->gap_start > 0) {
+		WidthIndex* widths = gb_widths_before_edit(gb);
         gb->gap_start -= 1;
 		gb->logical_size--;
+		if (widths) gb_widths_touch(gb, gb->gap_start, gb->gap_start + 1);
     }
 	return 1;
 }
 
 void gb_free(GapBuffer* gb) {
-    free(gb->buffer);
+	gb_release_buffer(gb);
+	gb_widths_free(gb);
 }
 
+// Take ownership of a freshly built buffer holding size bytes, gap at the end
+void gb_set_buffer(GapBuffer* gb, char* buffer, int size, int cap){
+	gb_release_buffer(gb);
+	gb_widths_free(gb);
+	gb->buffer = buffer;
+	gb->gap_start = size;
+	gb->gap_end = cap;
+	gb->cap = cap;
+	gb->logical_size = size;
+}
+
+
+
+
+
 
 char* gb_render(GapBuffer* gb) {
     char* rendered_text = malloc(sizeof(char) * (gb->logical_size + 1));
@@ -288,604 +890,6451 @@ int gb_print(GapBuffer* gb) {
 
 
 
-#define TAB_WIDTH 4
-#define LINE_NUM_WIDTH 5
-typedef struct LineNode {
-	GapBuffer* text;
-    struct LineNode* prev;   // Pointer to the previous line
-    struct LineNode* next;   // Pointer to the next line
-} LineNode;
+// Small LZ77 codec for cold line blocks. A block is a series of sequences:
+// a token (high nibble literal count, low nibble match length - 4, 15 = more bytes follow),
+// the literals, then a 2 byte offset and any extra match length bytes.
+// The final sequence carries only literals.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
 
+int lz_bound(int src_size){
+	return src_size + src_size / 255 + 16;
+}
 
-typedef struct {
-    LineNode* head;             // Head of the doubly linked list of lines
-    int line_count;				// # of nodes in the linked list of lines
-	
-	int line_number_width;     // Amount of columns that the line numbers take up
-	
-	int term_width;
-	int term_height;
+static uint32_t lz_read32(const char* p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
 
-	int row_offset;
-	int col_offset;
+static char* lz_write_length(char* op, int len){
+	while (len >= 255) {
+		*op++ = (char)255;
+		len -= 255;
+	}
+	*op++ = (char)len;
+	return op;
+}
 
-	LineNode* cursor_line_ref;  // Reference to the LineNode the cursor is on
-    int cursor_line_num;        // Line number where the cursor is
-    int cursor_pos;             // Position within the current line where the cursor is
-} TextEditor;
+static char* lz_write_sequence(char* op, const char* literals, int lit_len, int offset, int match_len){
+	int match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+	char* token = op++;
+	*token = (char)(((lit_len < 15 ? lit_len : 15) << 4) | (match_code < 15 ? match_code : 15));
 
+	if (lit_len >= 15) op = lz_write_length(op, lit_len - 15);
+	memcpy(op, literals, lit_len);
+	op += lit_len;
 
-void editor_update_terminal_dim(TextEditor* te){
-	
-	struct winsize ws;
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
-	te->term_width = ws.ws_col;
-	te->term_height = ws.ws_row;
+	if (match_len) {
+		*op++ = (char)(offset & 0xff);
+		*op++ = (char)(offset >> 8);
+		if (match_code >= 15) op = lz_write_length(op, match_code - 15);
+	}
+	return op;
 }
 
-void editor_init(TextEditor* te){
-	te->head = NULL;	
-	te->line_count = 0;
-	te->line_number_width = LINE_NUM_WIDTH;
+// Returns the compressed size. dst must hold lz_bound(src_size) bytes.
+int lz_compress(const char* src, int src_size, char* dst){
+	int table[1 << LZ_HASH_BITS];
+	memset(table, 0xff, sizeof(table));
+
+	char* op = dst;
+	int anchor = 0;
+	int ip = 0;
+	while (ip + LZ_MIN_MATCH <= src_size) {
+		uint32_t seq = lz_read32(src + ip);
+		uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int ref = table[h];
+		table[h] = ip;
+
+		if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(src + ref) != seq) {
+			ip++;
+			continue;
+		}
 
-	te->cursor_line_ref = NULL;
-	te->cursor_line_num = 0;
-	te->cursor_pos = 0;
-	te->row_offset = 0;
-	te->col_offset = 0;
+		int len = LZ_MIN_MATCH;
+		while (ip + len < src_size && src[ref + len] == src[ip + len]) len++;
 
-	editor_update_terminal_dim(te);
+		op = lz_write_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_write_sequence(op, src + anchor, src_size - anchor, 0, 0);
+	return op - dst;
 }
 
-void editor_free(TextEditor* te) {
-    LineNode* current = te->head;
-    while (current != NULL) {
-        LineNode* next = current->next;
-        gb_free(current->text);      // Free gap buffer text 
-        free(current->text);        // Free gap buffer object
-        free(current);                // Free line node
-        current = next;
-    }
-    te->head = NULL;
-    te->line_count = 0;
+static int lz_read_length(const unsigned char** ip, int len){
+	if (len < 15) return len;
+	unsigned char b;
+	do {
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
 }
 
+// dst must hold exactly raw_size bytes, the size passed to lz_compress
+void lz_decompress(const char* src, char* dst, int raw_size){
+	const unsigned char* ip = (const unsigned char*)src;
+	char* op = dst;
+	char* end = dst + raw_size;
+
+	while (1) {
+		unsigned char token = *ip++;
+		int lit_len = lz_read_length(&ip, token >> 4);
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+		if (op >= end) break;
+
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		int match_len = lz_read_length(&ip, token & 15) + LZ_MIN_MATCH;
+
+		// Matches may overlap their own output, so copy forwards a byte at a time
+		char* match = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, match, match_len);
+			op += match_len;
+		} else {
+			for (int i = 0; i < match_len; i++) *op++ = *match++;
+		}
+	}
+}
 
 
-char* editor_sanitize_line(char* text, int text_size, int* new_line_size){
 
-	// Count # of tabs
-	int num_tabs = 0;
-	for(int i = 0; i < text_size; i++){
-		if(text[i] == '\t') num_tabs++;
-	}
+// Syntax highlighting. Token boundaries come from a 256 entry character class table
+// and keywords from a switch trie the compiler turns into jump tables, so a line is
+// classified in one pass with no string comparisons beyond the final candidate.
 
-	// Render text
-	int rendered_size = ((text_size - num_tabs) + (num_tabs * TAB_WIDTH));
-	char* rendered_text = malloc(sizeof(char) * rendered_size);
-    if (!rendered_text) {
-        perror("malloc");
-        exit(1);
-    }
+typedef enum {
+    HL_NORMAL,
+    HL_KEYWORD,
+    HL_STRING,
+    HL_COMMENT,
+    HL_NUMBER,
+} HighlightType;
 
-	int index = 0;
-	for(int i = 0; i < text_size; i++){
-		// Tabs as spaces
-		if(text[i] == '\t'){
-			for(int j = 0; j < TAB_WIDTH; j++){
-				rendered_text[index] = ' ';
-				index++;
+// Lexer state carried from the end of one line to the start of the next
+#define HL_STATE_NORMAL 0
+#define HL_STATE_BLOCK_COMMENT 1
+
+#define CC_IDENT_START 0x01 // Letters, '_' and bytes of multibyte characters
+#define CC_IDENT 0x02
+#define CC_DIGIT 0x04
+#define CC_QUOTE 0x08
+#define CC_SPECIAL 0x10     // Characters that may start something other than a plain run
+
+static const unsigned char char_class[256] = {
+	['a' ... 'z'] = CC_IDENT_START | CC_IDENT,
+	['A' ... 'Z'] = CC_IDENT_START | CC_IDENT,
+	['_'] = CC_IDENT_START | CC_IDENT,
+	[0x80 ... 0xff] = CC_IDENT_START | CC_IDENT,
+	['0' ... '9'] = CC_DIGIT | CC_IDENT,
+	['"'] = CC_QUOTE | CC_SPECIAL,
+	['\''] = CC_QUOTE | CC_SPECIAL,
+	['/'] = CC_SPECIAL,
+	['#'] = CC_SPECIAL,
+};
+
+// C keywords. Add words by length and first letter; the switches are the trie
+int c_is_keyword(const char* s, int len){
+	switch (len) {
+		case 2:
+			switch (s[0]) {
+				case 'd': return memcmp(s + 1, "o", 1) == 0;
+				case 'i': return memcmp(s + 1, "f", 1) == 0;
 			}
-		} else {
+			return 0;
+		case 3:
+			switch (s[0]) {
+				case 'f': return memcmp(s + 1, "or", 2) == 0;
+				case 'i': return memcmp(s + 1, "nt", 2) == 0;
+			}
+			return 0;
+		case 4:
+			switch (s[0]) {
+				case 'a': return memcmp(s + 1, "uto", 3) == 0;
+				case 'c': return memcmp(s + 1, "ase", 3) == 0 || memcmp(s + 1, "har", 3) == 0;
+				case 'e': return memcmp(s + 1, "lse", 3) == 0 || memcmp(s + 1, "num", 3) == 0;
+				case 'g': return memcmp(s + 1, "oto", 3) == 0;
+				case 'l': return memcmp(s + 1, "ong", 3) == 0;
+				case 'v': return memcmp(s + 1, "oid", 3) == 0;
+			}
+			return 0;
+		case 5:
+			switch (s[0]) {
+				case '_': return memcmp(s + 1, "Bool", 4) == 0;
+				case 'b': return memcmp(s + 1, "reak", 4) == 0;
+				case 'c': return memcmp(s + 1, "onst", 4) == 0;
+				case 'f': return memcmp(s + 1, "loat", 4) == 0;
+				case 's': return memcmp(s + 1, "hort", 4) == 0;
+				case 'u': return memcmp(s + 1, "nion", 4) == 0;
+				case 'w': return memcmp(s + 1, "hile", 4) == 0;
+			}
+			return 0;
+		case 6:
+			switch (s[0]) {
+				case 'd': return memcmp(s + 1, "ouble", 5) == 0;
+				case 'e': return memcmp(s + 1, "xtern", 5) == 0;
+				case 'i': return memcmp(s + 1, "nline", 5) == 0;
+				case 'r': return memcmp(s + 1, "eturn", 5) == 0;
+				case 's': return memcmp(s + 1, "igned", 5) == 0 || memcmp(s + 1, "izeof", 5) == 0 || memcmp(s + 1, "tatic", 5) == 0 || memcmp(s + 1, "truct", 5) == 0 || memcmp(s + 1, "witch", 5) == 0;
+			}
+			return 0;
+		case 7:
+			switch (s[0]) {
+				case '_': return memcmp(s + 1, "Atomic", 6) == 0;
+				case 'd': return memcmp(s + 1, "efault", 6) == 0;
+				case 't': return memcmp(s + 1, "ypedef", 6) == 0;
+			}
+			return 0;
+		case 8:
+			switch (s[0]) {
+				case '_': return memcmp(s + 1, "Alignas", 7) == 0 || memcmp(s + 1, "Alignof", 7) == 0 || memcmp(s + 1, "Complex", 7) == 0 || memcmp(s + 1, "Generic", 7) == 0;
+				case 'c': return memcmp(s + 1, "ontinue", 7) == 0;
+				case 'r': return memcmp(s + 1, "egister", 7) == 0 || memcmp(s + 1, "estrict", 7) == 0;
+				case 'u': return memcmp(s + 1, "nsigned", 7) == 0;
+				case 'v': return memcmp(s + 1, "olatile", 7) == 0;
+			}
+			return 0;
+		case 9:
+			switch (s[0]) {
+				case '_': return memcmp(s + 1, "Noreturn", 8) == 0;
+			}
+			return 0;
+		case 13:
+			switch (s[0]) {
+				case '_': return memcmp(s + 1, "Thread_local", 12) == 0;
+			}
+			return 0;
+		case 14:
+			switch (s[0]) {
+				case '_': return memcmp(s + 1, "Static_assert", 13) == 0;
+			}
+			return 0;
+	}
+	return 0;
+}
+
+typedef struct {
+	const char* name;
+	const char* const* extensions;
+	int (*is_keyword)(const char* word, int len);
+} Syntax;
+
+static const char* const c_extensions[] = {".c", ".h", ".cc", ".cpp", ".hpp", NULL};
+
+static const Syntax syntaxes[] = {
+	{"c", c_extensions, c_is_keyword},
+};
+
+// Pick a language by file extension, NULL for plain text
+const Syntax* syntax_for_file(const char* filename){
+	const char* ext = filename ? strrchr(filename, '.') : NULL;
+	if (!ext) return NULL;
+
+	for (size_t i = 0; i < sizeof(syntaxes) / sizeof(syntaxes[0]); i++) {
+		for (const char* const* e = syntaxes[i].extensions; *e; e++) {
+			if (strcmp(ext, *e) == 0) return &syntaxes[i];
+		}
+	}
+	return NULL;
+}
+
+// Classify every byte of text into hl (one HighlightType per byte), starting in the
+// given lexer state. Returns the state at the end of the line
+int highlight_line(const Syntax* syntax, const char* text, int len, unsigned char* hl, int state){
+	int i = 0;
+
+	// Most bytes are plain, so fill once and only mark the tokens that are not
+	memset(hl, HL_NORMAL, len);
+
+	if (state == HL_STATE_BLOCK_COMMENT) {
+		while (i < len && !(text[i] == '*' && i + 1 < len && text[i + 1] == '/')) i++;
+		if (i == len) {
+			memset(hl, HL_COMMENT, len);
+			return HL_STATE_BLOCK_COMMENT;
+		}
+		i += 2;
+		memset(hl, HL_COMMENT, i);
+	}
+
+	while (i < len) {
+		unsigned char c = text[i];
+		unsigned char cls = char_class[c];
+		int start = i;
+
+		if (cls & CC_IDENT_START) {
+			while (i < len && (char_class[(unsigned char)text[i]] & CC_IDENT)) i++;
+			if (syntax->is_keyword(text + start, i - start)) {
+				for (int k = start; k < i; k++) hl[k] = HL_KEYWORD;
+			}
+		} else if (cls & CC_DIGIT) {
+			// Covers hex, suffixes and exponents: anything identifier-like or '.'
+			while (i < len && ((char_class[(unsigned char)text[i]] & CC_IDENT) || text[i] == '.')) i++;
+			for (int k = start; k < i; k++) hl[k] = HL_NUMBER;
+		} else if (cls & CC_QUOTE) {
+			i++;
+			while (i < len && text[i] != c) i += text[i] == '\\' ? 2 : 1;
+			if (i < len) i++;
+			if (i > len) i = len;
+			memset(hl + start, HL_STRING, i - start);
+		} else if (c == '/' && i + 1 < len && text[i + 1] == '/') {
+			memset(hl + start, HL_COMMENT, len - start);
+			return HL_STATE_NORMAL;
+		} else if (c == '/' && i + 1 < len && text[i + 1] == '*') {
+			i += 2;
+			while (i < len && !(text[i] == '*' && i + 1 < len && text[i + 1] == '/')) i++;
+			if (i == len) {
+				memset(hl + start, HL_COMMENT, len - start);
+				return HL_STATE_BLOCK_COMMENT;
+			}
+			i += 2;
+			memset(hl + start, HL_COMMENT, i - start);
+		} else if (c == '#') {
+			// Preprocessor directive name
+			i++;
+			while (i < len && (char_class[(unsigned char)text[i]] & CC_IDENT)) i++;
+			for (int k = start; k < i; k++) hl[k] = HL_KEYWORD;
+		} else {
+			// Run of punctuation and whitespace up to the next interesting byte
+			i++;
+			while (i < len && !(char_class[(unsigned char)text[i]] & (CC_IDENT | CC_SPECIAL))) i++;
+		}
+	}
+	return HL_STATE_NORMAL;
+}
+
+// Offset of the "*/" ending a block comment open at i, len if it runs past the line
+int block_comment_end(const char* text, int i, int len){
+	while (i + 1 < len) {
+		const char* star = memchr(text + i, '*', len - 1 - i);
+		if (!star) return len;
+		i = star - text;
+		if (text[i + 1] == '/') return i;
+		i++;
+	}
+	return len;
+}
+
+// The state highlight_line would return, without classifying any bytes. Only quotes
+// and comments carry across lines, so everything else is skipped in one tight loop.
+// Used for the background pass over the whole file, where nothing is drawn.
+int highlight_line_state(const char* text, int len, int state){
+	int i = 0;
+
+	if (state == HL_STATE_BLOCK_COMMENT) {
+		i = block_comment_end(text, 0, len);
+		if (i == len) return HL_STATE_BLOCK_COMMENT;
+		i += 2;
+	}
+
+	while (i < len) {
+		char c = text[i];
+		if (c == '"' || c == '\'') {
+			i++;
+			while (i < len && text[i] != c) i += text[i] == '\\' ? 2 : 1;
+			i++;
+		} else if (c == '/' && i + 1 < len && text[i + 1] == '/') {
+			return HL_STATE_NORMAL;
+		} else if (c == '/' && i + 1 < len && text[i + 1] == '*') {
+			i = block_comment_end(text, i + 2, len);
+			if (i == len) return HL_STATE_BLOCK_COMMENT;
+			i += 2;
+		} else {
+			i++;
+			while (i < len && text[i] != '"' && text[i] != '\'' && text[i] != '/') i++;
+		}
+	}
+	return HL_STATE_NORMAL;
+}
+
+
+#define TAB_WIDTH 4
+#define LINE_NUM_WIDTH 5
+struct ColdBlock;
+typedef struct LineNode {
+	GapBuffer* text;         // NULL while the line lives in a compressed cold block
+	struct ColdBlock* cold;
+    struct LineNode* prev;   // Pointer to the previous line
+    struct LineNode* next;   // Pointer to the next line
+
+	unsigned int version;    // Bumped on every edit, per-line caches compare against it
+
+	// Soft-wrap cache: wrap_rows is the value held in the editor's prefix sums,
+	// and is exact only while wrap_width and wrap_version still match
+	int wrap_rows;
+	int wrap_width;
+	unsigned int wrap_version;
+
+	// Display width cache, see line_col_map
+	int* col_map;
+	unsigned int width_version;
+	int width_known;
+
+	// Lexer state at the start of the line, filled in by the highlight worker.
+	// Lines it has not reached yet (hl_known == 0) are drawn as plain text
+	unsigned char hl_state_in;
+	int hl_known;
+} LineNode;
+
+// A run of consecutive lines far from the viewport, stored '\n' joined and compressed.
+// The lines of a block are always adjacent in the list: a cold line is thawed before it
+// is unlinked, and new lines are only linked after a line that is not cold.
+typedef struct ColdBlock {
+	LineNode* first;
+	int line_count;
+	int refs;                // Lines still pointing at the block
+	int raw_size;
+	int comp_size;
+	char data[];
+} ColdBlock;
+
+void cold_block_decode(ColdBlock* block, char* dst){
+	lz_decompress(block->data, dst, block->raw_size);
+}
+
+// Allocate an unlinked line around an existing gap buffer
+LineNode* line_alloc(GapBuffer* gb){
+	LineNode* line = malloc(sizeof(LineNode));
+	if (!line) {
+		perror("malloc");
+		exit(1);
+	}
+
+	line->text = gb;
+	line->cold = NULL;
+	line->prev = NULL;
+	line->next = NULL;
+	line->version = 0;
+	line->wrap_rows = 1;
+	line->wrap_width = 0;
+	line->wrap_version = 0;
+	line->col_map = NULL;
+	line->width_version = 0;
+	line->width_known = 0;
+	line->hl_state_in = HL_STATE_NORMAL;
+	line->hl_known = 0;
+	return line;
+}
+
+unsigned long cold_thaw_count = 0;
+
+// Decompress a block back into one gap buffer per line
+void cold_block_thaw(ColdBlock* block){
+	char* raw = malloc(block->raw_size + 1);
+	if (!raw) {
+		perror("malloc");
+		exit(1);
+	}
+	cold_block_decode(block, raw);
+
+	LineNode* line = block->first;
+	int line_start = 0;
+	for (int i = 0; i < block->line_count; i++) {
+		char* nl = memchr(raw + line_start, '\n', block->raw_size - line_start);
+		int line_end = nl ? nl - raw : block->raw_size;
+
+		line->text = malloc(sizeof(GapBuffer));
+		gb_init(line->text, raw + line_start, line_end - line_start);
+		line->cold = NULL;
+
+		line_start = line_end + 1;
+		line = line->next;
+	}
+
+	free(raw);
+	free(block);
+	cold_thaw_count++;
+}
+
+// Every access to a line's text goes through here so cold lines are decompressed on demand
+GapBuffer* line_gb(LineNode* line){
+	if (!line->text) cold_block_thaw(line->cold);
+	return line->text;
+}
+
+void line_free(LineNode* line){
+	free(line->col_map);
+	if (line->text) {
+		gb_free(line->text);
+		free(line->text);
+	} else if (--line->cold->refs == 0) {
+		free(line->cold);
+	}
+	free(line);
+}
+
+// Column map for a line. NULL means the line is pure ASCII and every byte is one column;
+// otherwise map[pos] is the column where the character holding byte pos starts,
+// with map[len] the total width. Rebuilt only after the line is edited.
+// Lines of LONG_LINE_BYTES or more use the gap buffer's WidthIndex instead and never
+// build one.
+int* line_col_map(LineNode* line){
+	if (line->width_known && line->width_version == line->version) return line->col_map;
+
+	GapBuffer* gb = line_gb(line);
+	free(line->col_map);
+	line->col_map = NULL;
+	line->width_known = 1;
+	line->width_version = line->version;
+
+	if (bytes_are_ascii(gb->buffer, gb->gap_start) &&
+		bytes_are_ascii(gb->buffer + gb->gap_end, gb->logical_size - gb->gap_start)) {
+		return NULL;
+	}
+
+	char* text = gb_render(gb);
+	int len = gb->logical_size;
+	int* map = malloc(sizeof(int) * (len + 1));
+	int col = 0;
+	int pos = 0;
+	while (pos < len) {
+		uint32_t cp;
+		int char_len = utf8_decode(text + pos, len - pos, &cp);
+		for (int i = 0; i < char_len; i++) map[pos + i] = col;
+		col += codepoint_width(cp);
+		pos += char_len;
+	}
+	map[len] = col;
+	free(text);
+
+	line->col_map = map;
+	return map;
+}
+
+int line_is_long(LineNode* line){
+	return line_gb(line)->logical_size >= LONG_LINE_BYTES;
+}
+
+int line_col_of(LineNode* line, int pos){
+	if (line_is_long(line)) return gb_col_of(line->text, pos);
+	int* map = line_col_map(line);
+	return map ? map[pos] : pos;
+}
+
+// First character boundary at or after col
+int line_pos_of_col(LineNode* line, int col){
+	if (line_is_long(line)) return gb_pos_of_col(line->text, col);
+	int* map = line_col_map(line);
+	int len = line->text->logical_size;
+	if (!map) return col < len ? col : len;
+
+	int lo = 0;
+	int hi = len;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (map[mid] < col) lo = mid + 1;
+		else hi = mid;
+	}
+	while (lo < len && utf8_is_continuation(gb_char_at(line->text, lo))) lo++;
+	return lo;
+}
+
+int line_char_end(LineNode* line, int pos){
+	int len = line->text->logical_size;
+	pos++;
+	while (pos < len && utf8_is_continuation(gb_char_at(line->text, pos))) pos++;
+	return pos;
+}
+
+// Whether the character starting at pos takes no columns
+int line_char_is_zero_width(LineNode* line, int* map, int pos){
+	int end = line_char_end(line, pos);
+	if (map) return map[end] == map[pos];
+
+	for (int i = pos; i < end; i++) {
+		if (gb_byte_width(line->text, i) != 0) return 0;
+	}
+	return 1;
+}
+
+// Step over one visible character, zero width marks included
+int line_next_char(LineNode* line, int pos){
+	int long_line = line_is_long(line);
+	int* map = long_line ? NULL : line_col_map(line);
+	int len = line->text->logical_size;
+	if (pos >= len) return len;
+	if (!map && !long_line) return pos + 1;
+
+	pos = line_char_end(line, pos);
+
+	// Zero width marks belong to the character before them
+	while (pos < len && line_char_is_zero_width(line, map, pos)) pos = line_char_end(line, pos);
+	return pos;
+}
+
+int line_prev_char(LineNode* line, int pos){
+	int long_line = line_is_long(line);
+	int* map = long_line ? NULL : line_col_map(line);
+	if (pos <= 0) return 0;
+	if (!map && !long_line) return pos - 1;
+
+	do {
+		pos--;
+		while (pos > 0 && utf8_is_continuation(gb_char_at(line->text, pos))) pos--;
+	} while (pos > 0 && line_char_is_zero_width(line, map, pos));
+	return pos;
+}
+
+
+
+typedef struct {
+	LineNode* line;
+	int line_num;
+	int pos;
+	int primary;                // The cursor tracked by cursor_line_ref / cursor_pos
+} Cursor;
+
+
+// Crash recovery journal. Every edit is appended as a small record to a swap file
+// next to the original. A writer thread writes the records out and fdatasyncs them in
+// batches, at most JOURNAL_SYNC_MS after the first edit of a batch, so one sync covers
+// a burst of typing and the editor never waits on the disk. Replaying the records over
+// the unchanged original rebuilds the session.
+
+#define JOURNAL_MAGIC 0x314a4c46 // "FLJ1"
+#define JOURNAL_SYNC_MS 200
+
+typedef enum {
+	J_INSERT = 1,               // len payload bytes inserted at pos
+	J_DELETE,                   // len bytes removed starting at pos
+	J_SPLIT,                    // Line broken in two at pos
+	J_JOIN,                     // Next line appended to this one
+	J_RESET,                    // Whole buffer replaced by the len byte payload
+	J_SET_LINE,                 // Text of the line replaced by the len byte payload
+} JournalOp;
+
+int journal_has_payload(int op){
+	return op == J_INSERT || op == J_RESET || op == J_SET_LINE;
+}
+
+typedef struct {
+	uint32_t magic;
+	uint32_t reserved;
+	int64_t base_size;          // Identity of the original file the records apply to
+	int64_t base_mtime_sec;
+	int64_t base_mtime_nsec;
+} JournalHeader;
+
+typedef struct {
+	uint32_t checksum;          // hash_bytes of the rest of the record and its payload
+	uint32_t op;
+	uint32_t line;
+	uint32_t pos;
+	uint32_t len;
+} JournalRecord;
+
+typedef struct Journal {
+	int fd;
+	char* path;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char* pending;              // Records the writer thread has not taken yet
+	size_t pending_size;
+	size_t pending_cap;
+	int stop;
+} Journal;
+
+// dir/.name.editor-swap for dir/name. Not .swp, which is Vim's and not ours to touch
+char* journal_path(const char* filename){
+	const char* slash = strrchr(filename, '/');
+	int dir_len = slash ? slash - filename + 1 : 0;
+	char* path = malloc(strlen(filename) + 14);
+	if (!path) {
+		perror("malloc");
+		exit(1);
+	}
+	sprintf(path, "%.*s.%s.editor-swap", dir_len, filename, filename + dir_len);
+	return path;
+}
+
+void journal_header_from(const struct stat* st, JournalHeader* header){
+	memset(header, 0, sizeof(JournalHeader));
+	header->magic = JOURNAL_MAGIC;
+	header->base_size = st->st_size;
+	header->base_mtime_sec = st->st_mtim.tv_sec;
+	header->base_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+int journal_header_for(const char* filename, JournalHeader* header){
+	struct stat st;
+	if (stat(filename, &st) < 0) return 0;
+
+	journal_header_from(&st, header);
+	return 1;
+}
+
+int write_all(int fd, const char* data, size_t size){
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0) return 0;
+		data += n;
+		size -= n;
+	}
+	return 1;
+}
+
+void* journal_writer_main(void* arg){
+	Journal* j = arg;
+	char* batch = NULL;
+	size_t batch_cap = 0;
+
+	pthread_mutex_lock(&j->lock);
+	while (1) {
+		while (!j->stop && j->pending_size == 0) pthread_cond_wait(&j->cond, &j->lock);
+		if (j->stop && j->pending_size == 0) break;
+
+		// Let the rest of the burst pile up so a single sync covers it
+		if (!j->stop) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += JOURNAL_SYNC_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			while (!j->stop && pthread_cond_timedwait(&j->cond, &j->lock, &deadline) == 0) {}
+		}
+
+		// Take the batch and leave the emptied buffer for new records
+		char* records = j->pending;
+		size_t records_cap = j->pending_cap;
+		size_t size = j->pending_size;
+		j->pending = batch;
+		j->pending_cap = batch_cap;
+		j->pending_size = 0;
+		batch = records;
+		batch_cap = records_cap;
+		pthread_mutex_unlock(&j->lock);
+
+		if (write_all(j->fd, records, size)) fdatasync(j->fd);
+
+		pthread_mutex_lock(&j->lock);
+	}
+	pthread_mutex_unlock(&j->lock);
+	free(batch);
+	return NULL;
+}
+
+// Wrap an open swap file positioned at its end
+Journal* journal_start(int fd, char* path){
+	Journal* j = malloc(sizeof(Journal));
+	if (!j) {
+		perror("malloc");
+		exit(1);
+	}
+	j->fd = fd;
+	j->path = path;
+	j->pending = NULL;
+	j->pending_size = 0;
+	j->pending_cap = 0;
+	j->stop = 0;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	if (pthread_create(&j->thread, NULL, journal_writer_main, j) != 0) {
+		pthread_mutex_destroy(&j->lock);
+		pthread_cond_destroy(&j->cond);
+		close(fd);
+		free(path);
+		free(j);
+		return NULL;
+	}
+	return j;
+}
+
+// Start a fresh swap file for filename, whose on-disk identity is base. Fails rather
+// than overwrite a file already there. The lock tells other editors it is in use
+Journal* journal_create(const char* filename, const JournalHeader* base){
+	char* path = journal_path(filename);
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0 || !write_all(fd, (const char*)base, sizeof(JournalHeader))) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(path);
+		}
+		free(path);
+		return NULL;
+	}
+	return journal_start(fd, path);
+}
+
+void journal_append(Journal* j, int op, int line, int pos, const char* text, int len){
+	int has_text = journal_has_payload(op);
+	size_t size = sizeof(JournalRecord) + (has_text ? len : 0);
+
+	pthread_mutex_lock(&j->lock);
+	if (j->pending_size + size > j->pending_cap) {
+		j->pending_cap = (j->pending_size + size) * 2;
+		j->pending = realloc(j->pending, j->pending_cap);
+		if (!j->pending) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	char* dst = j->pending + j->pending_size;
+	JournalRecord rec = {0, op, line, pos, len};
+	memcpy(dst, &rec, sizeof(rec));
+	if (has_text) memcpy(dst + sizeof(rec), text, len);
+	rec.checksum = hash_bytes(dst + sizeof(uint32_t), size - sizeof(uint32_t));
+	memcpy(dst, &rec.checksum, sizeof(uint32_t));
+
+	if (j->pending_size == 0) pthread_cond_signal(&j->cond);
+	j->pending_size += size;
+	pthread_mutex_unlock(&j->lock);
+}
+
+// The original grew under the journal (follow mode), its records still apply to it.
+// Returns 0 if the header could not be rewritten
+int journal_set_base(Journal* j, const JournalHeader* base){
+	return pwrite(j->fd, base, sizeof(JournalHeader), 0) == sizeof(JournalHeader);
+}
+
+// Flush whatever is pending and stop the writer. remove deletes the swap file
+void journal_close(Journal* j, int remove){
+	pthread_mutex_lock(&j->lock);
+	j->stop = 1;
+	pthread_cond_signal(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	pthread_join(j->thread, NULL);
+
+	close(j->fd);
+	if (remove) unlink(j->path);
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	free(j->pending);
+	free(j->path);
+	free(j);
+}
+
+
+// Lines a replace-all changed, with the text each had before. Undoing puts those
+// texts back, which is only valid while nothing else has edited the buffer since
+typedef struct UndoStep {
+	LineNode** lines;
+	int* line_nums;
+	char** texts;               // Owned, each sized for gb_set_buffer
+	int* sizes;
+	int count;
+	unsigned int edit_serial;   // The editor's hl_edit_serial right after the step
+	struct UndoStep* prev;
+} UndoStep;
+
+// Brackets left unmatched in a range of lines, see the bracket index. Each kind is
+// counted on its own, so one never closes another
+#define BRACKET_KINDS 3         // (), [] and {}
+typedef struct {
+	int lines;
+	int close[BRACKET_KINDS];   // Closing brackets with no opening one before them
+	int open[BRACKET_KINDS];    // Opening brackets with no closing one after them
+} BracketSummary;
+
+typedef struct {
+	LineNode* first;
+	BracketSummary sum;
+	int dirty;                  // Text changed since sum was taken
+} BracketLeaf;
+
+typedef struct {
+	BracketLeaf* leaves;
+	int leaf_count;
+	int leaf_cap;
+	BracketSummary* tree;       // Segment tree over the leaves, node 1 is the root
+	int size;                   // Leaf slots in the tree, a power of two
+	int* dirty;                 // Leaves to rescan before the next lookup
+	int dirty_count;
+	int dirty_cap;
+	int built;
+	unsigned int version;       // structure_version the leaves were laid out for
+	unsigned char* code;        // Scratch for bracket_line_code
+	int code_cap;
+} BracketIndex;
+
+#define UNDO_MAX_STEPS 16
+#define PROMPT_MAX 256
+
+typedef enum {
+	PROMPT_NONE,
+	PROMPT_FIND,                // Typing the text to replace
+	PROMPT_REPLACE,             // Typing what to replace it with
+} PromptState;
+
+// How a buffer's lines are currently held in memory
+typedef enum {
+	BUF_LOADED,                 // One LineNode + GapBuffer per line
+	BUF_PACKED,                 // Modified, lines squeezed into one contiguous block
+	BUF_ON_DISK,                // Unmodified, lines dropped and re-read from the file on demand
+} BufferState;
+
+typedef struct {
+    LineNode* head;             // Head of the doubly linked list of lines
+    int line_count;				// # of nodes in the linked list of lines
+	
+	int line_number_width;     // Amount of columns that the line numbers take up
+	
+	int term_width;
+	int term_height;
+
+	int row_offset;
+	int col_offset;
+
+	LineNode* cursor_line_ref;  // Reference to the LineNode the cursor is on
+    int cursor_line_num;        // Line number where the cursor is
+    int cursor_pos;             // Position within the current line where the cursor is
+
+	// File on disk backing the editor
+	char* filename;
+	uint32_t* disk_line_hashes; // Hash of every line as it was last read from disk
+	int disk_line_count;
+	int watch_fd;               // inotify instance, -1 when not watching
+	int watch_wd;
+	int reload_pending;         // File changed while the buffer was compacted
+
+	// Tail-follow: bytes appended to the file are read and added at the end, see editor_follow_read
+	int follow;
+	long disk_size;             // Bytes of the file the buffer holds
+	ino_t disk_ino;
+	LineNode* tail;             // Last line, valid while structure_version == tail_version
+	unsigned int tail_version;
+
+	// Buffer bookkeeping
+	int dirty;                  // Modified since it was read from disk
+	BufferState state;
+	char* packed;               // Newline separated lines while BUF_PACKED
+	long packed_size;
+	time_t last_active;
+	size_t mem_bytes;           // Memory used, measured when the buffer was last switched away from
+
+	int cold_anchor;            // row_offset when lines around the viewport were last frozen
+	unsigned long cold_sweep_thaws;
+
+	unsigned int structure_version; // Bumped whenever lines are inserted or removed
+
+	// Soft wrap: a Fenwick tree over per-line row counts maps screen rows to lines
+	int soft_wrap;
+	int wrap_width;             // Text width the tree was built for
+	int* wrap_tree;
+	int wrap_tree_lines;
+	unsigned int wrap_tree_version;
+	int wrap_top_row;           // Visual row shown at the top of the screen
+
+	// Extra cursors for multi-cursor editing, the primary one is not included
+	Cursor* cursors;
+	int cursor_count;
+	int cursor_cap;
+
+	// Redraw tracking: only damaged rows are repainted unless something moved the view
+	unsigned char* row_damage;
+	int damage_rows;
+	int full_redraw;
+	int last_row_offset;
+	int last_col_offset;
+	int last_line_count;
+	int last_cursor_line;
+	OutBuffer frame;            // Reused by every frame, sized for the screen
+
+	// Syntax highlighting, NULL for plain text. Scratch buffers hold one line at a time
+	const Syntax* syntax;
+	char* hl_text;
+	unsigned char* hl_buf;
+	int hl_cap;
+
+	// Background analysis: lines before hl_frontier have the start state the worker
+	// computed for their current text. The pass resumes at hl_resume_line in state
+	// hl_resume_state, and may stop early once past hl_dirty_end
+	int hl_frontier;
+	int hl_dirty_end;
+	LineNode* hl_resume_line;
+	unsigned char hl_resume_state;
+	unsigned int hl_edit_serial;   // Bumped on every invalidation, stale jobs are dropped
+	int hl_job_pending;
+
+	// Crash recovery, see Journal. The swap file is created on the first edit
+	Journal* journal;
+	JournalHeader journal_base; // Identity of the on-disk file the edits apply to
+	int journal_off;            // Not journaling: replaying, or the swap file failed
+
+	int out_fd;                 // Where frames are written: the terminal, or a server client
+	OutQueue* out_queue;        // Set when out_fd is a non-blocking client socket
+	int attached;               // Open in a server client, never compacted meanwhile
+
+	BracketIndex brackets;      // Built on first use
+
+	UndoStep* undo;             // Newest replace-all first
+	int undo_depth;
+
+	// Replace-all prompt on the bottom row, see editor_prompt_key
+	PromptState prompt;
+	char prompt_text[PROMPT_MAX];
+	int prompt_len;
+	char find_text[PROMPT_MAX];
+	int find_len;
+} TextEditor;
+
+
+// A client that cannot keep up gets the rest of the output queued, behind anything
+// already waiting so frames arrive in order
+void editor_write(TextEditor* te, const char* data, size_t size){
+	OutQueue* q = te->out_queue;
+	if (!q) {
+		write(te->out_fd, data, size);
+		return;
+	}
+	if (q->overflow) return;
+
+	ssize_t n = 0;
+	if (q->pending.size == 0) {
+		n = write(te->out_fd, data, size);
+		if (n < 0) n = 0;
+	}
+	if ((size_t)n == size) return;
+	if (q->pending.size + size - n > OUT_QUEUE_MAX) {
+		q->overflow = 1;
+		return;
+	}
+	ob_append(&q->pending, (char*)data + n, size - n);
+}
+
+// Only works when out_fd is a terminal; the server is told its clients' sizes instead
+void editor_update_terminal_dim(TextEditor* te){
+	
+	struct winsize ws;
+	if (ioctl(te->out_fd, TIOCGWINSZ, &ws) < 0) return;
+	te->term_width = ws.ws_col;
+	te->term_height = ws.ws_row;
+}
+
+void editor_init(TextEditor* te){
+	te->head = NULL;	
+	te->line_count = 0;
+	te->line_number_width = LINE_NUM_WIDTH;
+
+	te->cursor_line_ref = NULL;
+	te->cursor_line_num = 0;
+	te->cursor_pos = 0;
+	te->row_offset = 0;
+	te->col_offset = 0;
+
+	te->filename = NULL;
+	te->disk_line_hashes = NULL;
+	te->disk_line_count = 0;
+	te->watch_fd = -1;
+	te->watch_wd = -1;
+	te->reload_pending = 0;
+	te->follow = 0;
+	te->disk_size = 0;
+	te->disk_ino = 0;
+	te->tail = NULL;
+	te->tail_version = 0;
+
+	te->dirty = 0;
+	te->state = BUF_LOADED;
+	te->packed = NULL;
+	te->packed_size = 0;
+	te->last_active = time(NULL);
+	te->mem_bytes = 0;
+
+	te->cold_anchor = 0;
+	te->cold_sweep_thaws = 0;
+
+	te->structure_version = 0;
+	te->soft_wrap = 0;
+	te->wrap_width = 0;
+	te->wrap_tree = NULL;
+	te->wrap_tree_lines = 0;
+	te->wrap_tree_version = 0;
+	te->wrap_top_row = 0;
+
+	te->cursors = NULL;
+	te->cursor_count = 0;
+	te->cursor_cap = 0;
+
+	te->row_damage = NULL;
+	te->damage_rows = 0;
+	te->full_redraw = 1;
+	te->last_row_offset = -1;
+	te->last_col_offset = -1;
+	te->last_line_count = -1;
+	te->last_cursor_line = -1;
+	ob_init(&te->frame);
+	te->syntax = NULL;
+	te->hl_text = NULL;
+	te->hl_buf = NULL;
+	te->hl_cap = 0;
+	te->hl_frontier = 0;
+	te->hl_dirty_end = 0;
+	te->hl_resume_line = NULL;
+	te->hl_resume_state = HL_STATE_NORMAL;
+	te->hl_edit_serial = 0;
+	te->hl_job_pending = 0;
+	te->journal = NULL;
+	memset(&te->journal_base, 0, sizeof(JournalHeader));
+	te->journal_off = 0;
+	te->out_fd = STDOUT_FILENO;
+	te->out_queue = NULL;
+	te->attached = 0;
+	memset(&te->brackets, 0, sizeof(BracketIndex));
+	te->undo = NULL;
+	te->undo_depth = 0;
+	te->prompt = PROMPT_NONE;
+	te->prompt_len = 0;
+	te->find_len = 0;
+
+	te->term_width = 80;
+	te->term_height = 24;
+	editor_update_terminal_dim(te);
+}
+
+void bracket_index_free(BracketIndex* ix){
+	free(ix->leaves);
+	free(ix->tree);
+	free(ix->dirty);
+	free(ix->code);
+	memset(ix, 0, sizeof(BracketIndex));
+}
+
+void undo_step_free(UndoStep* step){
+	for (int i = 0; i < step->count; i++) free(step->texts[i]);
+	free(step->lines);
+	free(step->line_nums);
+	free(step->texts);
+	free(step->sizes);
+	free(step);
+}
+
+void editor_undo_clear(TextEditor* te){
+	while (te->undo) {
+		UndoStep* prev = te->undo->prev;
+		undo_step_free(te->undo);
+		te->undo = prev;
+	}
+	te->undo_depth = 0;
+}
+
+void editor_free(TextEditor* te) {
+    LineNode* current = te->head;
+    while (current != NULL) {
+        LineNode* next = current->next;
+        line_free(current);
+        current = next;
+    }
+    te->head = NULL;
+    te->line_count = 0;
+
+	if (te->watch_fd >= 0) close(te->watch_fd);
+	te->watch_fd = -1;
+	free(te->disk_line_hashes);
+	te->disk_line_hashes = NULL;
+	te->disk_line_count = 0;
+	free(te->filename);
+	te->filename = NULL;
+	free(te->packed);
+	te->packed = NULL;
+	free(te->wrap_tree);
+	te->wrap_tree = NULL;
+	free(te->cursors);
+	te->cursors = NULL;
+	te->cursor_count = 0;
+	free(te->row_damage);
+	te->row_damage = NULL;
+	te->damage_rows = 0;
+	free(te->frame.buffer);
+	te->frame.buffer = NULL;
+	te->frame.cap = 0;
+	te->frame.size = 0;
+	free(te->hl_text);
+	free(te->hl_buf);
+	te->hl_text = NULL;
+	te->hl_buf = NULL;
+	te->hl_cap = 0;
+	editor_undo_clear(te);
+	bracket_index_free(&te->brackets);
+
+	// A clean shutdown leaves nothing to recover. There is no save, so unsaved edits
+	// stay in the swap file and are replayed the next time the file is opened
+	if (te->journal) journal_close(te->journal, !te->dirty);
+	te->journal = NULL;
+}
+
+
+
+char* editor_sanitize_line(char* text, int text_size, int* new_line_size){
+
+	// Count # of tabs
+	int num_tabs = 0;
+	for(int i = 0; i < text_size; i++){
+		if(text[i] == '\t') num_tabs++;
+	}
+
+	// Render text
+	size_t rendered_size = (size_t)(unsigned int)text_size + (size_t)num_tabs * (TAB_WIDTH - 1);
+	char* rendered_text = malloc(sizeof(char) * rendered_size);
+    if (!rendered_text) {
+        perror("malloc");
+        exit(1);
+    }
+
+	int index = 0;
+	for(int i = 0; i < text_size; i++){
+		// Tabs as spaces
+		if(text[i] == '\t'){
+			for(int j = 0; j < TAB_WIDTH; j++){
+				rendered_text[index] = ' ';
+				index++;
+			}
+		} else {
 			rendered_text[index] = text[i];
 			index++;
 		}
 	}
-	
-	*new_line_size = index;
-	return rendered_text;
+	
+	*new_line_size = index;
+	return rendered_text;
+}
+
+// Walk to line n, starting from whichever known node is closest
+LineNode* editor_line_at(TextEditor* te, int n){
+	if (n < 0 || n >= te->line_count) return NULL;
+
+	LineNode* line = te->head;
+	int line_num = 0;
+	if (te->cursor_line_ref && abs(te->cursor_line_num - n) < n) {
+		line = te->cursor_line_ref;
+		line_num = te->cursor_line_num;
+	}
+
+	while (line_num < n) {
+		line = line->next;
+		line_num++;
+	}
+	while (line_num > n) {
+		line = line->prev;
+		line_num--;
+	}
+	return line;
+}
+
+// Lines within this many rows of the viewport are never compressed
+#define COLD_MARGIN_LINES 256
+#define COLD_BLOCK_LINES 128
+
+// Blocks are sized with ints, a run too big for one stays uncompressed
+#define COLD_MAX_RAW ((size_t)INT_MAX - INT_MAX / 255 - 16)
+
+// Compress raw, the newline separated text of count lines starting at first
+ColdBlock* cold_block_create(LineNode* first, int count, const char* raw, int raw_size){
+	char* comp = malloc(lz_bound(raw_size));
+	if (!comp) {
+		perror("malloc");
+		exit(1);
+	}
+	int comp_size = lz_compress(raw, raw_size, comp);
+	ColdBlock* block = malloc(sizeof(ColdBlock) + comp_size);
+	if (!block) {
+		perror("malloc");
+		exit(1);
+	}
+	block->first = first;
+	block->line_count = count;
+	block->refs = count;
+	block->raw_size = raw_size;
+	block->comp_size = comp_size;
+	memcpy(block->data, comp, comp_size);
+	free(comp);
+	return block;
+}
+
+// Compress count adjacent uncompressed lines into one cold block
+void editor_freeze_run(LineNode* first, int count){
+	if (count <= 0) return;
+	size_t raw_size = count - 1;
+	LineNode* line = first;
+	for (int i = 0; i < count; i++, line = line->next) raw_size += line->text->logical_size;
+	if (raw_size > COLD_MAX_RAW) return;
+
+	char* raw = malloc(raw_size + 1);
+	if (!raw) {
+		perror("malloc");
+		exit(1);
+	}
+
+	int offset = 0;
+	line = first;
+	for (int i = 0; i < count; i++, line = line->next) {
+		GapBuffer* gb = line->text;
+		memcpy(raw + offset, gb->buffer, gb->gap_start);
+		memcpy(raw + offset + gb->gap_start, gb->buffer + gb->gap_end, gb->logical_size - gb->gap_start);
+		offset += gb->logical_size;
+		if (i + 1 < count) raw[offset++] = '\n';
+	}
+
+	ColdBlock* block = cold_block_create(first, count, raw, raw_size);
+	free(raw);
+
+	line = first;
+	for (int i = 0; i < count; i++, line = line->next) {
+		gb_free(line->text);
+		free(line->text);
+		free(line->col_map);
+		line->text = NULL;
+		line->col_map = NULL;
+		line->width_known = 0;
+		line->cold = block;
+	}
+}
+
+int editor_line_is_hot(TextEditor* te, int line_num){
+	return line_num >= te->row_offset - COLD_MARGIN_LINES &&
+		   line_num < te->row_offset + te->term_height + COLD_MARGIN_LINES;
+}
+
+// Freeze every line in [start_num, end_num) that is far enough from the viewport
+void editor_freeze_lines(TextEditor* te, int start_num, int end_num){
+	if (start_num < 0) start_num = 0;
+	if (end_num > te->line_count) end_num = te->line_count;
+	if (start_num >= end_num) return;
+
+	LineNode* line = editor_line_at(te, start_num);
+	LineNode* run = NULL;
+	int run_len = 0;
+	for (int n = start_num; n < end_num; n++, line = line->next) {
+		int eligible = line->text && line != te->cursor_line_ref && !editor_line_is_hot(te, n);
+		if (!eligible) {
+			if (run_len) editor_freeze_run(run, run_len);
+			run_len = 0;
+			continue;
+		}
+
+		if (run_len == 0) run = line;
+		if (++run_len == COLD_BLOCK_LINES) {
+			editor_freeze_run(run, run_len);
+			run_len = 0;
+		}
+	}
+	if (run_len) editor_freeze_run(run, run_len);
+}
+
+// Called as lines are appended while building a buffer, so a huge file never sits fully uncompressed
+void editor_freeze_tail(TextEditor* te, LineNode* last){
+	if (te->line_count % COLD_BLOCK_LINES != 0) return;
+
+	int first_num = te->line_count - COLD_BLOCK_LINES;
+	if (editor_line_is_hot(te, first_num) || editor_line_is_hot(te, te->line_count - 1)) return;
+
+	// Only the uncompressed run at the end is taken. After edits above it, the last
+	// block's worth of lines can reach back into ones that are already frozen
+	if (!last->text || last == te->cursor_line_ref) return;
+	LineNode* first = last;
+	int count = 1;
+	while (count < COLD_BLOCK_LINES && first->prev && first->prev->text && first->prev != te->cursor_line_ref) {
+		first = first->prev;
+		count++;
+	}
+	editor_freeze_run(first, count);
+}
+
+// Re-freeze what was thawed around the old viewport once it has scrolled far enough away
+void editor_cold_maintain(TextEditor* te){
+	if (abs(te->row_offset - te->cold_anchor) <= COLD_MARGIN_LINES) return;
+
+	editor_freeze_lines(te, te->cold_anchor - COLD_MARGIN_LINES, te->cold_anchor + te->term_height + COLD_MARGIN_LINES);
+	te->cold_anchor = te->row_offset;
+}
+
+// Full pass for idle time, skipped when nothing has been thawed since the last one
+void editor_cold_sweep(TextEditor* te){
+	if (te->state != BUF_LOADED || te->cold_sweep_thaws == cold_thaw_count) return;
+
+	editor_freeze_lines(te, 0, te->line_count);
+	te->cold_sweep_thaws = cold_thaw_count;
+	te->cold_anchor = te->row_offset;
+}
+
+// Build an unlinked line node from raw (unsanitized) text
+LineNode* line_create(char* text, int text_size){
+	GapBuffer* gb = malloc(sizeof(GapBuffer));
+	if (!gb) {
+		perror("malloc");
+		exit(1);
+	}
+
+	int line_size = 0;
+	char* sanitized = editor_sanitize_line(text, text_size, &line_size);
+	gb_init(gb, sanitized, line_size);
+	free(sanitized);
+
+	return line_alloc(gb);
+}
+
+// Record an edit in the swap journal, creating it on the first one
+void editor_journal(TextEditor* te, int op, int line, int pos, const char* text, int len){
+	if (te->journal_off || !te->filename) return;
+	if (!te->journal) {
+		te->journal = journal_create(te->filename, &te->journal_base);
+		if (!te->journal) {
+			log_to_file("Cannot create swap file for %s", te->filename);
+			te->journal_off = 1;
+			return;
+		}
+	}
+	journal_append(te->journal, op, line, pos, text, len);
+}
+
+// Bracket index. Lines are grouped into leaves of about BRACKET_LEAF_LINES, and a
+// segment tree over the leaves holds, for every range of lines, its line count and the
+// brackets left unmatched inside it. Finding where a block ends walks down the tree to
+// the first range whose closing brackets outnumber the depth still open, so only the
+// lines at both ends are ever read. Brackets inside strings and comments are skipped
+// using the start state the highlighter found for each line. Edits, and start states
+// that change, mark their leaf dirty; dirty leaves are rescanned when the index is next
+// used. Line splits and joins adjust a leaf in place, anything else that moves lines
+// around has the index rebuilt on its next use.
+
+// Reads the text of lines in list order, decoding each cold block once instead of thawing it
+typedef struct {
+	ColdBlock* block;
+	char* raw;
+	int raw_cap;
+	int offset;                 // Where the text of next starts in raw
+	LineNode* next;
+	char* scratch;
+	int scratch_cap;
+} LineReader;
+
+void line_reader_init(LineReader* r){
+	memset(r, 0, sizeof(LineReader));
+}
+
+void line_reader_free(LineReader* r){
+	free(r->raw);
+	free(r->scratch);
+}
+
+const char* line_reader_text(LineReader* r, LineNode* line, int* size){
+	if (line->text) {
+		GapBuffer* gb = line->text;
+		*size = gb->logical_size;
+		if (gb->gap_start == 0) return gb->buffer + gb->gap_end;
+		if (gb->gap_start >= (int)gb->logical_size) return gb->buffer;
+
+		if (*size > r->scratch_cap) {
+			r->scratch_cap = *size * 2;
+			r->scratch = realloc(r->scratch, r->scratch_cap);
+			if (!r->scratch) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		gb_copy_range(gb, 0, *size, r->scratch);
+		return r->scratch;
+	}
+
+	ColdBlock* block = line->cold;
+	if (block != r->block || line != r->next) {
+		if (block != r->block) {
+			if (block->raw_size + 1 > r->raw_cap) {
+				r->raw_cap = block->raw_size + 1;
+				r->raw = realloc(r->raw, r->raw_cap);
+				if (!r->raw) {
+					perror("realloc");
+					exit(1);
+				}
+			}
+			cold_block_decode(block, r->raw);
+			r->block = block;
+		}
+		r->offset = 0;
+		for (LineNode* l = block->first; l != line; l = l->next) {
+			r->offset = (char*)memchr(r->raw + r->offset, '\n', block->raw_size - r->offset) - r->raw + 1;
+		}
+	}
+
+	char* nl = memchr(r->raw + r->offset, '\n', block->raw_size - r->offset);
+	int end = nl ? nl - r->raw : block->raw_size;
+	const char* text = r->raw + r->offset;
+	*size = end - r->offset;
+	r->offset = end + 1;
+	r->next = line->next;
+	return text;
+}
+
+#define BRACKET_LEAF_LINES 64
+
+int bracket_is_open(char c){
+	return c == '(' || c == '[' || c == '{';
+}
+
+int bracket_is_close(char c){
+	return c == ')' || c == ']' || c == '}';
+}
+
+int bracket_kind(char c){
+	switch (c) {
+		case '(': case ')': return 0;
+		case '[': case ']': return 1;
+		case '{': case '}': return 2;
+	}
+	return -1;
+}
+
+BracketSummary bracket_combine(BracketSummary a, BracketSummary b){
+	BracketSummary sum = { a.lines + b.lines, {0}, {0} };
+	for (int k = 0; k < BRACKET_KINDS; k++) {
+		int matched = a.open[k] < b.close[k] ? a.open[k] : b.close[k];
+		sum.close[k] = a.close[k] + b.close[k] - matched;
+		sum.open[k] = a.open[k] + b.open[k] - matched;
+	}
+	return sum;
+}
+
+// Bytes a bracket scan stops at. Brackets hold their kind plus one
+#define BC_OPEN 0x04
+#define BC_QUOTE 0x08
+#define BC_SLASH 0x10
+static const unsigned char bracket_class[256] = {
+	['('] = BC_OPEN | 1, ['['] = BC_OPEN | 2, ['{'] = BC_OPEN | 3,
+	[')'] = 1, [']'] = 2, ['}'] = 3,
+	['"'] = BC_QUOTE, ['\''] = BC_QUOTE,
+	['/'] = BC_SLASH,
+};
+
+// Adds the brackets of text from i on to sum. With lex set, strings and comments are
+// skipped the way highlight_line_state lexes them, and cleared in code when it is given
+void bracket_scan_text(const char* text, int len, int i, int lex, BracketSummary* sum, unsigned char* code){
+	while (i < len) {
+		unsigned char cls = bracket_class[(unsigned char)text[i]];
+		if (!cls) {
+			i++;
+			continue;
+		}
+
+		int start = i;
+		if (lex && (cls & BC_QUOTE)) {
+			char quote = text[i++];
+			while (i < len && text[i] != quote) i += text[i] == '\\' ? 2 : 1;
+			i = i < len ? i + 1 : len;
+		} else if (lex && (cls & BC_SLASH) && i + 1 < len && text[i + 1] == '/') {
+			i = len;
+		} else if (lex && (cls & BC_SLASH) && i + 1 < len && text[i + 1] == '*') {
+			i = block_comment_end(text, i + 2, len);
+			i = i < len ? i + 2 : len;
+		}
+		if (i > start) {
+			if (code) memset(code + start, 0, i - start);
+			continue;
+		}
+
+		int k = (cls & 3) - 1;
+		if (k >= 0) {
+			if (cls & BC_OPEN) sum->open[k]++;
+			else if (sum->open[k] > 0) sum->open[k]--;
+			else sum->close[k]++;
+		}
+		i++;
+	}
+}
+
+// With a syntax, brackets in strings and comments do not count. Lexing starts from the
+// state the highlighter found for the line; one it has not reached yet is taken to start
+// outside a comment until editor_hl_apply says otherwise
+int bracket_code_start(TextEditor* te, LineNode* line, const char* text, int len){
+	if (!te->syntax || !line->hl_known || line->hl_state_in != HL_STATE_BLOCK_COMMENT) return 0;
+	int end = block_comment_end(text, 0, len);
+	return end < len ? end + 2 : len;
+}
+
+BracketSummary bracket_scan_line(TextEditor* te, LineReader* r, LineNode* line){
+	int size;
+	const char* text = line_reader_text(r, line, &size);
+	BracketSummary sum = { 1, {0}, {0} };
+	bracket_scan_text(text, size, bracket_code_start(te, line, text, size), te->syntax != NULL, &sum, NULL);
+	return sum;
+}
+
+// Which bytes of a line count for brackets, NULL without a syntax when all of them do
+const unsigned char* bracket_line_code(TextEditor* te, LineNode* line, const char* text, int len){
+	if (!te->syntax) return NULL;
+	BracketIndex* ix = &te->brackets;
+	if (len > ix->code_cap) {
+		ix->code_cap = len * 2;
+		ix->code = realloc(ix->code, ix->code_cap);
+		if (!ix->code) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	BracketSummary unused = { 0, {0}, {0} };
+	int start = bracket_code_start(te, line, text, len);
+	memset(ix->code, 0, start);
+	memset(ix->code + start, 1, len - start);
+	bracket_scan_text(text, len, start, 1, &unused, ix->code);
+	return ix->code;
+}
+
+// Summarize a leaf from its lines
+void bracket_leaf_scan(TextEditor* te, int leaf, LineReader* r){
+	BracketLeaf* l = &te->brackets.leaves[leaf];
+	BracketSummary sum = { 0, {0}, {0} };
+	LineNode* line = l->first;
+	for (int i = 0; i < l->sum.lines; i++, line = line->next) sum = bracket_combine(sum, bracket_scan_line(te, r, line));
+	l->sum = sum;
+}
+
+void bracket_tree_update(BracketIndex* ix, int leaf){
+	int node = ix->size + leaf;
+	ix->tree[node] = ix->leaves[leaf].sum;
+	for (node /= 2; node >= 1; node /= 2) ix->tree[node] = bracket_combine(ix->tree[2 * node], ix->tree[2 * node + 1]);
+}
+
+// Lay the tree out again over the current leaves
+void bracket_tree_build(BracketIndex* ix){
+	int size = 1;
+	while (size < ix->leaf_count) size *= 2;
+	if (size != ix->size) {
+		free(ix->tree);
+		ix->tree = malloc(sizeof(BracketSummary) * 2 * size);
+		if (!ix->tree) {
+			perror("malloc");
+			exit(1);
+		}
+		ix->size = size;
+	}
+
+	BracketSummary none = { 0, {0}, {0} };
+	for (int i = 0; i < size; i++) ix->tree[size + i] = i < ix->leaf_count ? ix->leaves[i].sum : none;
+	for (int node = size - 1; node >= 1; node--) ix->tree[node] = bracket_combine(ix->tree[2 * node], ix->tree[2 * node + 1]);
+}
+
+void bracket_index_build(TextEditor* te){
+	BracketIndex* ix = &te->brackets;
+	ix->leaf_count = 0;
+	ix->dirty_count = 0;
+
+	LineReader r;
+	line_reader_init(&r);
+	for (LineNode* line = te->head; line != NULL; line = line->next) {
+		if (ix->leaf_count == 0 || ix->leaves[ix->leaf_count - 1].sum.lines == BRACKET_LEAF_LINES) {
+			if (ix->leaf_count == ix->leaf_cap) {
+				ix->leaf_cap = ix->leaf_cap ? ix->leaf_cap * 2 : 64;
+				ix->leaves = realloc(ix->leaves, sizeof(BracketLeaf) * ix->leaf_cap);
+				if (!ix->leaves) {
+					perror("realloc");
+					exit(1);
+				}
+			}
+			BracketLeaf* leaf = &ix->leaves[ix->leaf_count++];
+			leaf->first = line;
+			leaf->sum = (BracketSummary){ 0, {0}, {0} };
+			leaf->dirty = 0;
+		}
+		BracketLeaf* leaf = &ix->leaves[ix->leaf_count - 1];
+		leaf->sum = bracket_combine(leaf->sum, bracket_scan_line(te, &r, line));
+	}
+	line_reader_free(&r);
+
+	bracket_tree_build(ix);
+	ix->version = te->structure_version;
+	ix->built = 1;
+}
+
+int bracket_index_valid(TextEditor* te){
+	return te->brackets.built && te->brackets.version == te->structure_version;
+}
+
+// Leaf holding line_num, and the number of its first line
+int bracket_leaf_of(BracketIndex* ix, int line_num, int* first_num){
+	int node = 1;
+	*first_num = 0;
+	while (node < ix->size) {
+		node *= 2;
+		if (line_num >= *first_num + ix->tree[node].lines) {
+			*first_num += ix->tree[node].lines;
+			node++;
+		}
+	}
+	return node - ix->size;
+}
+
+// Rescan the leaves edited since the index was last used
+void bracket_index_flush(TextEditor* te){
+	BracketIndex* ix = &te->brackets;
+	if (ix->dirty_count == 0) return;
+
+	LineReader r;
+	line_reader_init(&r);
+	for (int i = 0; i < ix->dirty_count; i++) {
+		int leaf = ix->dirty[i];
+		bracket_leaf_scan(te, leaf, &r);
+		bracket_tree_update(ix, leaf);
+		ix->leaves[leaf].dirty = 0;
+	}
+	line_reader_free(&r);
+	ix->dirty_count = 0;
+}
+
+void bracket_mark_dirty(BracketIndex* ix, int leaf){
+	if (ix->leaves[leaf].dirty) return;
+	if (ix->dirty_count == ix->dirty_cap) {
+		ix->dirty_cap = ix->dirty_cap ? ix->dirty_cap * 2 : 16;
+		ix->dirty = realloc(ix->dirty, sizeof(int) * ix->dirty_cap);
+		if (!ix->dirty) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	ix->leaves[leaf].dirty = 1;
+	ix->dirty[ix->dirty_count++] = leaf;
+}
+
+// The text of line_num changed
+void bracket_index_touch(TextEditor* te, int line_num){
+	if (!bracket_index_valid(te) || line_num >= te->line_count) return;
+	int first_num;
+	bracket_mark_dirty(&te->brackets, bracket_leaf_of(&te->brackets, line_num, &first_num));
+}
+
+// A line was just linked in after line_num. Called right after structure_version moved on
+void bracket_index_insert(TextEditor* te, int line_num){
+	BracketIndex* ix = &te->brackets;
+	if (!ix->built || ix->version + 1 != te->structure_version) return;
+	ix->version = te->structure_version;
+
+	int first_num;
+	int leaf = bracket_leaf_of(ix, line_num, &first_num);
+	ix->leaves[leaf].sum.lines++;
+	bracket_tree_update(ix, leaf);
+	bracket_mark_dirty(ix, leaf);
+	if (ix->leaves[leaf].sum.lines <= 2 * BRACKET_LEAF_LINES) return;
+
+	// Split the leaf in two
+	bracket_index_flush(te);
+	if (ix->leaf_count == ix->leaf_cap) {
+		ix->leaf_cap *= 2;
+		ix->leaves = realloc(ix->leaves, sizeof(BracketLeaf) * ix->leaf_cap);
+		if (!ix->leaves) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memmove(ix->leaves + leaf + 2, ix->leaves + leaf + 1, sizeof(BracketLeaf) * (ix->leaf_count - leaf - 1));
+	ix->leaf_count++;
+
+	BracketLeaf* left = &ix->leaves[leaf];
+	BracketLeaf* right = &ix->leaves[leaf + 1];
+	int half = left->sum.lines / 2;
+	right->first = left->first;
+	for (int i = 0; i < half; i++) right->first = right->first->next;
+	right->sum.lines = left->sum.lines - half;
+	right->dirty = 0;
+	left->sum.lines = half;
+
+	LineReader r;
+	line_reader_init(&r);
+	bracket_leaf_scan(te, leaf, &r);
+	bracket_leaf_scan(te, leaf + 1, &r);
+	line_reader_free(&r);
+	bracket_tree_build(ix);
+}
+
+// Line line_num, node, is about to be unlinked and freed. Called right after
+// structure_version moved on
+void bracket_index_remove(TextEditor* te, int line_num, LineNode* node){
+	BracketIndex* ix = &te->brackets;
+	if (!ix->built || ix->version + 1 != te->structure_version) return;
+	ix->version = te->structure_version;
+
+	int first_num;
+	int leaf = bracket_leaf_of(ix, line_num, &first_num);
+	BracketLeaf* l = &ix->leaves[leaf];
+	if (l->first == node) l->first = node->next;
+	l->sum.lines--;
+	if (l->sum.lines > 0) {
+		bracket_tree_update(ix, leaf);
+		bracket_mark_dirty(ix, leaf);
+		return;
+	}
+
+	bracket_index_flush(te);
+	memmove(ix->leaves + leaf, ix->leaves + leaf + 1, sizeof(BracketLeaf) * (ix->leaf_count - leaf - 1));
+	ix->leaf_count--;
+	bracket_tree_build(ix);
+}
+
+// First leaf at or after from in which the closing brackets of kind k outnumber depth.
+// Leaves passed over update depth and add their lines to line_num
+int bracket_find_close(BracketIndex* ix, int k, int node, int lo, int hi, int from, int* depth, int* line_num){
+	if (hi < from) return -1;
+	BracketSummary* sum = &ix->tree[node];
+	if (lo >= from && sum->close[k] < *depth) {
+		*depth += sum->open[k] - sum->close[k];
+		*line_num += sum->lines;
+		return -1;
+	}
+	if (lo == hi) return lo;
+
+	int mid = (lo + hi) / 2;
+	int leaf = bracket_find_close(ix, k, 2 * node, lo, mid, from, depth, line_num);
+	if (leaf >= 0) return leaf;
+	return bracket_find_close(ix, k, 2 * node + 1, mid + 1, hi, from, depth, line_num);
+}
+
+// Last leaf at or before to in which the opening brackets of kind k outnumber depth, walking
+// backwards. Leaves passed over take their lines off line_num
+int bracket_find_open(BracketIndex* ix, int k, int node, int lo, int hi, int to, int* depth, int* line_num){
+	if (lo > to) return -1;
+	BracketSummary* sum = &ix->tree[node];
+	if (hi <= to && sum->open[k] < *depth) {
+		*depth += sum->close[k] - sum->open[k];
+		*line_num -= sum->lines;
+		return -1;
+	}
+	if (lo == hi) return lo;
+
+	int mid = (lo + hi) / 2;
+	int leaf = bracket_find_open(ix, k, 2 * node + 1, mid + 1, hi, to, depth, line_num);
+	if (leaf >= 0) return leaf;
+	return bracket_find_open(ix, k, 2 * node, lo, mid, to, depth, line_num);
+}
+
+// Bracket of kind k in a line, from start towards step, that brings depth to zero.
+// depth is updated as brackets pass; returns -1 if the line ends first
+int bracket_find_in_line(const char* text, int size, const unsigned char* code, int k, int start, int step, int* depth){
+	for (int i = start; i >= 0 && i < size; i += step) {
+		if (bracket_kind(text[i]) != k || (code && !code[i])) continue;
+		*depth += bracket_is_open(text[i]) ? step : -step;
+		if (*depth == 0) return i;
+	}
+	return -1;
+}
+
+// Where the bracket at pos on line_num is matched. Only brackets of its own kind count
+// toward the nesting depth, and none inside strings or comments. Returns 0 if there is
+// no bracket there, it is in a string or comment, or it is unmatched
+int editor_bracket_match(TextEditor* te, LineNode* line, int line_num, int pos, LineNode** out_line, int* out_num, int* out_pos){
+	LineReader r;
+	line_reader_init(&r);
+	int size;
+	const char* text = line_reader_text(&r, line, &size);
+	const unsigned char* code = bracket_line_code(te, line, text, size);
+	int k = pos >= 0 && pos < size ? bracket_kind(text[pos]) : -1;
+	if (k < 0 || (code && !code[pos])) {
+		line_reader_free(&r);
+		return 0;
+	}
+	int forward = bracket_is_open(text[pos]);
+
+	// The rest of the line comes first
+	int depth = 1;
+	int step = forward ? 1 : -1;
+	int found_pos = bracket_find_in_line(text, size, code, k, pos + step, step, &depth);
+	if (found_pos >= 0) {
+		line_reader_free(&r);
+		*out_line = line;
+		*out_num = line_num;
+		*out_pos = found_pos;
+		return 1;
+	}
+
+	if (!bracket_index_valid(te)) bracket_index_build(te);
+	BracketIndex* ix = &te->brackets;
+	bracket_index_flush(te);
+
+	// Then the other lines of its leaf, then whole subtrees, then lines of the leaf found
+	int first_num;
+	int leaf = bracket_leaf_of(ix, line_num, &first_num);
+	int last_num = first_num + ix->leaves[leaf].sum.lines - 1;
+	LineNode* found = NULL;
+	int num = line_num;
+	for (LineNode* l = forward ? line->next : line->prev; l && num != (forward ? last_num : first_num); l = forward ? l->next : l->prev) {
+		num += step;
+		BracketSummary sum = bracket_scan_line(te, &r, l);
+		if (forward ? sum.close[k] >= depth : sum.open[k] >= depth) {
+			found = l;
+			break;
+		}
+		depth += forward ? sum.open[k] - sum.close[k] : sum.close[k] - sum.open[k];
+	}
+
+	if (!found) {
+		num = forward ? last_num + 1 : first_num - 1;
+		int target = forward ? bracket_find_close(ix, k, 1, 0, ix->size - 1, leaf + 1, &depth, &num)
+							 : bracket_find_open(ix, k, 1, 0, ix->size - 1, leaf - 1, &depth, &num);
+		if (target < 0 || target >= ix->leaf_count) {
+			line_reader_free(&r);
+			return 0;
+		}
+
+		// num is now the leaf's first line, or its last one walking back
+		BracketLeaf* t = &ix->leaves[target];
+		LineNode* l = t->first;
+		if (!forward) for (int i = 1; i < t->sum.lines; i++) l = l->next;
+		for (int i = 0; i < t->sum.lines; i++, l = forward ? l->next : l->prev, num += step) {
+			BracketSummary sum = bracket_scan_line(te, &r, l);
+			if (forward ? sum.close[k] >= depth : sum.open[k] >= depth) {
+				found = l;
+				break;
+			}
+			depth += forward ? sum.open[k] - sum.close[k] : sum.close[k] - sum.open[k];
+		}
+	}
+	if (!found) {
+		line_reader_free(&r);
+		return 0;
+	}
+
+	// Find the bracket inside the line
+	text = line_reader_text(&r, found, &size);
+	code = bracket_line_code(te, found, text, size);
+	found_pos = bracket_find_in_line(text, size, code, k, forward ? 0 : size - 1, step, &depth);
+	line_reader_free(&r);
+	if (found_pos < 0) return 0;
+	*out_line = found;
+	*out_num = num;
+	*out_pos = found_pos;
+	return 1;
+}
+
+// Restart background highlighting from the first line
+void editor_hl_reset(TextEditor* te){
+	te->hl_frontier = 0;
+	te->hl_dirty_end = 0;
+	te->hl_resume_line = NULL;
+	te->hl_resume_state = HL_STATE_NORMAL;
+	te->hl_edit_serial++;
+}
+
+// The text of line changed, so the start states of the lines after it may have too.
+// line must survive the edit: callers pass the first line of a split or join
+void editor_hl_invalidate(TextEditor* te, LineNode* line, int line_num){
+	bracket_index_touch(te, line_num);
+	te->hl_edit_serial++;
+	if (line_num > te->hl_dirty_end) te->hl_dirty_end = line_num;
+	if (line_num >= te->hl_frontier) return;
+
+	if (line_num > 0 && !line->hl_known) {
+		editor_hl_reset(te);
+		return;
+	}
+	te->hl_frontier = line_num;
+	te->hl_resume_line = line;
+	te->hl_resume_state = line_num > 0 ? line->hl_state_in : HL_STATE_NORMAL;
+}
+
+// End of the count lines starting at start (their last newline, or the end of the
+// text), or -1 if the text runs out first
+long text_lines_end(const char* text, long text_size, long start, int count){
+	long pos = start;
+	for (int i = 0; i < count; i++) {
+		char* nl = memchr(text + pos, '\n', text_size - pos);
+		if (!nl) return i == count - 1 ? text_size : -1;
+		pos = nl - text + 1;
+	}
+	return pos - 1;
+}
+
+// Link count lines, whose text is raw, after last and hold them in one cold block
+LineNode* editor_append_cold(TextEditor* te, LineNode* last, const char* raw, int raw_size, int count){
+	LineNode* first = NULL;
+	for (int i = 0; i < count; i++) {
+		LineNode* line = line_alloc(NULL);
+		line->prev = last;
+		if (last) last->next = line;
+		else te->head = line;
+		if (!first) first = line;
+		last = line;
+	}
+	te->line_count += count;
+
+	ColdBlock* block = cold_block_create(first, count, raw, raw_size);
+	for (LineNode* line = first; line != NULL; line = line->next) line->cold = block;
+	return last;
+}
+
+void editor_set_text(TextEditor* te, char* text, int text_size) {
+	LineNode* current_line = NULL;
+	long line_start = 0;
+
+	// Treat end of text as a newline
+	while (line_start <= text_size) {
+
+		// Lines that editor_freeze_tail would compress as soon as they were added skip
+		// their gap buffers. Tabs are expanded by line_create, so those take the slow path
+		if (te->line_count % COLD_BLOCK_LINES == 0 && !editor_line_is_hot(te, te->line_count) &&
+			!editor_line_is_hot(te, te->line_count + COLD_BLOCK_LINES - 1)) {
+			long end = text_lines_end(text, text_size, line_start, COLD_BLOCK_LINES);
+			if (end >= 0 && (size_t)(end - line_start) <= COLD_MAX_RAW &&
+				!memchr(text + line_start, '\t', end - line_start)) {
+				current_line = editor_append_cold(te, current_line, text + line_start, end - line_start, COLD_BLOCK_LINES);
+				line_start = end + 1;
+				continue;
+			}
+		}
+
+		char* nl = memchr(text + line_start, '\n', text_size - line_start);
+		long line_end = nl ? nl - text : text_size;
+
+		// Create new line
+		LineNode* new_line = line_create(text + line_start, line_end - line_start);
+
+		// Add new line node to linked list
+		new_line->prev = current_line;
+		new_line->next = NULL;
+		if (current_line == NULL) te->head = new_line; // First line
+		else current_line->next = new_line;
+
+		current_line = new_line;
+		te->line_count++;
+		editor_freeze_tail(te, new_line);
+
+		// Move to the next line
+		line_start = line_end + 1;
+	}
+	te->structure_version++;
+	editor_hl_reset(te);
+}
+
+
+void editor_set_cursor_to_first_line(TextEditor* te) {
+    if (te->head) {
+        te->cursor_line_ref = te->head;
+        te->cursor_line_num = 0; 
+        te->cursor_pos = 0;
+    }
+}
+
+
+// Mark a line's row for repainting on the next frame. Rows are counted from the
+// view currently on screen, the renderer shifts them if that view scrolls
+void editor_damage_line(TextEditor* te, int line_num){
+	if (te->damage_rows != te->term_height) {
+		te->row_damage = realloc(te->row_damage, te->term_height > 0 ? te->term_height : 1);
+		te->damage_rows = te->term_height;
+		memset(te->row_damage, 0, te->damage_rows);
+		te->full_redraw = 1;
+	}
+
+	int row = line_num - te->last_row_offset;
+	if (row >= 0 && row < te->damage_rows) te->row_damage[row] = 1;
+}
+
+void editor_insert_char(TextEditor* te, char c){
+	editor_journal(te, J_INSERT, te->cursor_line_num, te->cursor_pos, &c, 1);
+	gb_insert(line_gb(te->cursor_line_ref), te->cursor_pos, c);
+	te->cursor_line_ref->version++;
+	te->dirty = 1;
+	editor_damage_line(te, te->cursor_line_num);
+	editor_hl_invalidate(te, te->cursor_line_ref, te->cursor_line_num);
+}
+
+// Removes the byte before the cursor
+void editor_remove_char(TextEditor* te){
+	if (te->cursor_pos <= 0) return;
+	editor_journal(te, J_DELETE, te->cursor_line_num, te->cursor_pos - 1, NULL, 1);
+	gb_delete(line_gb(te->cursor_line_ref), te->cursor_pos);
+	te->cursor_line_ref->version++;
+	te->dirty = 1;
+	editor_damage_line(te, te->cursor_line_num);
+	editor_hl_invalidate(te, te->cursor_line_ref, te->cursor_line_num);
+}
+
+// Append the line after line to it and drop that line
+void editor_join_line(TextEditor* te, LineNode* line, int line_num){
+	LineNode* next_line = line->next;
+	editor_journal(te, J_JOIN, line_num, 0, NULL, 0);
+
+	GapBuffer* next_text = line_gb(next_line);
+	gb_move_gap(next_text, next_text->logical_size);
+	gb_insert_chunk(line_gb(line), line_gb(line)->logical_size, next_text->buffer, next_text->logical_size);
+
+	line->next = next_line->next;
+	if (next_line->next) next_line->next->prev = line;
+	te->structure_version++;
+	bracket_index_remove(te, line_num + 1, next_line);
+	line_free(next_line);
+
+	te->line_count--;
+	te->dirty = 1;
+	line->version++;
+	editor_hl_invalidate(te, line, line_num);
+}
+
+// Split line (number line_num) at split_index, moving the text after it onto a new line linked right after
+LineNode* editor_split_line(TextEditor* te, LineNode* line, int line_num, int split_index){
+	// Create new line
+	GapBuffer* gb = malloc(sizeof(GapBuffer));
+	GapBuffer* text = line_gb(line);
+
+    // Move the gap in the current line to the split index
+    gb_move_gap(text, split_index);
+
+    // Initialize new line's gap buffer with text after the split
+    char* after_split_text = text->buffer + text->gap_end;
+    int after_split_size = text->cap - text->gap_end;
+    gb_init(gb, after_split_text, after_split_size);
+    LineNode* new_line = line_alloc(gb);
+
+    // Truncate the current line's logical size to the split index
+    text->logical_size = split_index;
+    text->gap_end = text->cap;
+	line->version++;
+
+	// Don't let the head of a long line keep its whole buffer, Enter pressed again and
+	// again near the start of one would hold a copy of it per line
+	if (text->cap - split_index > LONG_LINE_BYTES) {
+		int cap = split_index + INIT_GAP_SIZE;
+		char* buffer = malloc(sizeof(char) * cap);
+		if (!buffer) {
+			perror("malloc");
+			exit(1);
+		}
+		memcpy(buffer, text->buffer, split_index);
+		gb_set_buffer(text, buffer, split_index, cap);
+	}
+
+    // Update the linked list
+    if (line->next) {
+        line->next->prev = new_line;
+        new_line->next = line->next;
+    } else {
+        new_line->next = NULL;
+    }
+    new_line->prev = line;
+    line->next = new_line;
+
+	te->dirty = 1;
+	te->structure_version++;
+	te->line_count++;
+	bracket_index_insert(te, line_num);
+	te->full_redraw = 1;
+	return new_line;
+}
+
+void editor_insert_newline(TextEditor* te){
+	editor_journal(te, J_SPLIT, te->cursor_line_num, te->cursor_pos, NULL, 0);
+	editor_hl_invalidate(te, te->cursor_line_ref, te->cursor_line_num);
+	LineNode* new_line = editor_split_line(te, te->cursor_line_ref, te->cursor_line_num, te->cursor_pos);
+
+	// Update Editor fields
+	te->cursor_line_ref = new_line;
+	te->cursor_line_num++;
+    te->cursor_pos = 0;
+
+	// No offset 
+	te->col_offset = 0;
+
+	if (te->cursor_line_num >= te->row_offset + te->term_height) {
+		te->row_offset = te->cursor_line_num - te->term_height + 1;
+	}
+}
+
+int editor_text_width(TextEditor* te){
+	int width = te->term_width - te->line_number_width;
+	return width > 0 ? width : 1;
+}
+
+// Adjust col_offset so the cursor's display column is visible
+void editor_scroll_to_cursor(TextEditor* te){
+	int col = line_col_of(te->cursor_line_ref, te->cursor_pos);
+	int width = editor_text_width(te);
+
+    if (col < te->col_offset) {
+        te->col_offset = col; // Scroll left
+    } else if (col >= te->col_offset + width) {
+        te->col_offset = col - width + 1; // Scroll right
+    }
+}
+
+void handle_cursor_line_move(TextEditor* te, LineNode* current, LineNode* goal){
+	// Keep the display column rather than the byte offset
+	int col = line_col_of(current, te->cursor_pos);
+	line_gb(goal);
+	te->cursor_pos = line_pos_of_col(goal, col);
+
+	// If when moving the cursor ot new line, the text is not visible due to the col_offset
+    // Adjust col_offset to ensure the cursor is visible
+	int width = editor_text_width(te);
+	int goal_col = line_col_of(goal, te->cursor_pos);
+    if (goal_col < te->col_offset) {
+        te->col_offset = goal_col; // Scroll left
+    } else if (goal_col >= te->col_offset + width) {
+        te->col_offset = goal_col - width + 1; // Scroll right
+    }
+}
+
+void editor_cursor_up(TextEditor* te){
+	// Bounds Check
+	if(te->cursor_line_num <= 0) return;
+
+	handle_cursor_line_move(te, te->cursor_line_ref, te->cursor_line_ref->prev );
+	te->cursor_line_ref = te->cursor_line_ref->prev;
+	te->cursor_line_num--;
+	
+	// Handle Scrolling up
+	if (te->cursor_line_num < te->row_offset) {
+		te->row_offset--;
+	}
+}
+
+void editor_cursor_down(TextEditor* te){
+	// Bounds Check
+	if(!te->cursor_line_ref->next) return;
+
+	handle_cursor_line_move(te, te->cursor_line_ref, te->cursor_line_ref->next );
+	te->cursor_line_ref = te->cursor_line_ref->next;
+	te->cursor_line_num++;
+
+
+	// Handle Scrolling down
+	if (te->cursor_line_num >= te->row_offset + te->term_height) {
+		te->row_offset++;
+	}
+}
+
+// Put the cursor at pos on line
+void editor_jump_to(TextEditor* te, LineNode* line, int line_num, int pos){
+	editor_damage_line(te, te->cursor_line_num);
+	te->cursor_line_ref = line;
+	te->cursor_line_num = line_num;
+	te->cursor_pos = pos;
+	editor_damage_line(te, line_num);
+
+	// A jump off screen lands in the middle of it
+	if (line_num < te->row_offset || line_num >= te->row_offset + te->term_height) {
+		te->row_offset = line_num > te->term_height / 2 ? line_num - te->term_height / 2 : 0;
+	}
+	editor_scroll_to_cursor(te);
+}
+
+// Move to the bracket matching the one under the cursor, or the one just before it
+void editor_jump_to_bracket(TextEditor* te){
+	LineNode* line;
+	int line_num, pos;
+	if (!editor_bracket_match(te, te->cursor_line_ref, te->cursor_line_num, te->cursor_pos, &line, &line_num, &pos) &&
+		!editor_bracket_match(te, te->cursor_line_ref, te->cursor_line_num, te->cursor_pos - 1, &line, &line_num, &pos)) {
+		return;
+	}
+	editor_jump_to(te, line, line_num, pos);
+}
+
+
+// Multi-cursor editing. Every cursor, primary included, is gathered into one sorted
+// array so a keystroke is applied in a single pass: each line's gap buffer is touched
+// once no matter how many cursors sit on it, and each affected row is damaged once.
+
+int cursor_compare(const void* a, const void* b){
+	const Cursor* ca = a;
+	const Cursor* cb = b;
+	if (ca->line_num != cb->line_num) return ca->line_num - cb->line_num;
+	return ca->pos - cb->pos;
+}
+
+// All cursors sorted by position, duplicates merged into whichever one is primary
+Cursor* editor_gather_cursors(TextEditor* te, int* count){
+	Cursor* all = malloc(sizeof(Cursor) * (te->cursor_count + 1));
+	memcpy(all, te->cursors, sizeof(Cursor) * te->cursor_count);
+	all[te->cursor_count] = (Cursor){ te->cursor_line_ref, te->cursor_line_num, te->cursor_pos, 1 };
+	qsort(all, te->cursor_count + 1, sizeof(Cursor), cursor_compare);
+
+	int n = 0;
+	for (int i = 0; i <= te->cursor_count; i++) {
+		if (n > 0 && all[n - 1].line == all[i].line && all[n - 1].pos == all[i].pos) {
+			all[n - 1].primary |= all[i].primary;
+			continue;
+		}
+		all[n++] = all[i];
+	}
+	*count = n;
+	return all;
+}
+
+void editor_scatter_cursors(TextEditor* te, Cursor* all, int count){
+	te->cursor_count = 0;
+	for (int i = 0; i < count; i++) {
+		if (all[i].primary) {
+			te->cursor_line_ref = all[i].line;
+			te->cursor_line_num = all[i].line_num;
+			te->cursor_pos = all[i].pos;
+			continue;
+		}
+		te->cursors[te->cursor_count++] = all[i];
+	}
+	free(all);
+}
+
+void editor_add_cursor(TextEditor* te, LineNode* line, int line_num, int pos){
+	if (te->cursor_count == te->cursor_cap) {
+		te->cursor_cap = te->cursor_cap ? te->cursor_cap * 2 : 16;
+		te->cursors = realloc(te->cursors, sizeof(Cursor) * te->cursor_cap);
+	}
+	te->cursors[te->cursor_count++] = (Cursor){ line, line_num, pos, 0 };
+	editor_damage_line(te, line_num);
+}
+
+// Add a cursor on the line below the lowest one, at the same display column
+void editor_add_cursor_below(TextEditor* te){
+	LineNode* line = te->cursor_line_ref;
+	int line_num = te->cursor_line_num;
+	int pos = te->cursor_pos;
+	for (int i = 0; i < te->cursor_count; i++) {
+		if (te->cursors[i].line_num > line_num) {
+			line = te->cursors[i].line;
+			line_num = te->cursors[i].line_num;
+			pos = te->cursors[i].pos;
+		}
+	}
+	if (!line->next) return;
+
+	int col = line_col_of(line, pos);
+	line_gb(line->next);
+	editor_add_cursor(te, line->next, line_num + 1, line_pos_of_col(line->next, col));
+}
+
+void editor_clear_cursors(TextEditor* te){
+	for (int i = 0; i < te->cursor_count; i++) editor_damage_line(te, te->cursors[i].line_num);
+	te->cursor_count = 0;
+}
+
+// Insert text at every cursor. With to_tab_stop each cursor gets just enough of
+// text (spaces) to reach its own next tab stop, len is ignored.
+void editor_multi_insert(TextEditor* te, const char* text, int len, int to_tab_stop){
+	int count;
+	Cursor* all = editor_gather_cursors(te, &count);
+	int* lens = malloc(sizeof(int) * count);
+	if (!lens) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (int i = 0; i < count; ) {
+		LineNode* line = all[i].line;
+		GapBuffer* gb = line_gb(line);
+		int j = i;
+		while (j < count && all[j].line == line) j++;
+
+		// Spaces inserted earlier on the line push later cursors right by as many columns
+		int added = 0;
+		for (int k = i; k < j; k++) {
+			lens[k] = to_tab_stop ? TAB_WIDTH - (line_col_of(line, all[k].pos) + added) % TAB_WIDTH : len;
+			added += lens[k];
+		}
+
+		if (j - i == 1) {
+			editor_journal(te, J_INSERT, all[i].line_num, all[i].pos, text, lens[i]);
+			gb_insert_chunk(gb, all[i].pos, text, lens[i]);
+			all[i].pos += lens[i];
+		} else {
+			// Several cursors on one line: rebuild it in one pass instead of moving the gap per cursor
+			int size = gb->logical_size + added;
+			int cap = size + INIT_GAP_SIZE;
+			char* buffer = malloc(cap);
+			int src = 0;
+			int dst = 0;
+			for (int k = i; k < j; k++) {
+				gb_copy_range(gb, src, all[k].pos - src, buffer + dst);
+				dst += all[k].pos - src;
+				src = all[k].pos;
+				editor_journal(te, J_INSERT, all[k].line_num, dst, text, lens[k]);
+				memcpy(buffer + dst, text, lens[k]);
+				dst += lens[k];
+				all[k].pos = dst;
+			}
+			gb_copy_range(gb, src, gb->logical_size - src, buffer + dst);
+			gb_set_buffer(gb, buffer, size, cap);
+		}
+
+		line->version++;
+		editor_damage_line(te, all[i].line_num);
+		editor_hl_invalidate(te, line, all[i].line_num);
+		i = j;
+	}
+
+	free(lens);
+	te->dirty = 1;
+	editor_scatter_cursors(te, all, count);
+	editor_scroll_to_cursor(te);
+}
+
+// Delete the character before every cursor. A cursor at the start of a line joins
+// it onto the line above, the same as Backspace does with one cursor.
+void editor_multi_backspace(TextEditor* te){
+	int count;
+	Cursor* all = editor_gather_cursors(te, &count);
+	char* at_start = malloc(count);
+	if (!at_start) {
+		perror("malloc");
+		exit(1);
+	}
+	for (int i = 0; i < count; i++) at_start[i] = all[i].pos == 0;
+
+	for (int i = 0; i < count; ) {
+		LineNode* line = all[i].line;
+		GapBuffer* gb = line_gb(line);
+		int j = i;
+		while (j < count && all[j].line == line) j++;
+
+		// Start of the character each cursor removes
+		int* starts = malloc(sizeof(int) * (j - i));
+		for (int k = i; k < j; k++) starts[k - i] = line_prev_char(line, all[k].pos);
+
+		if (j - i == 1) {
+			if (all[i].pos > starts[0]) editor_journal(te, J_DELETE, all[i].line_num, starts[0], NULL, all[i].pos - starts[0]);
+			for (int pos = all[i].pos; pos > starts[0]; pos--) gb_delete(gb, pos);
+			all[i].pos = starts[0];
+		} else {
+			char* buffer = malloc(gb->logical_size + INIT_GAP_SIZE);
+			int src = 0;
+			int dst = 0;
+			for (int k = i; k < j; k++) {
+				gb_copy_range(gb, src, starts[k - i] - src, buffer + dst);
+				dst += starts[k - i] - src;
+				if (all[k].pos > starts[k - i]) editor_journal(te, J_DELETE, all[k].line_num, dst, NULL, all[k].pos - starts[k - i]);
+				src = all[k].pos;
+				all[k].pos = dst;
+			}
+			gb_copy_range(gb, src, gb->logical_size - src, buffer + dst);
+			dst += gb->logical_size - src;
+			gb_set_buffer(gb, buffer, dst, gb->logical_size + INIT_GAP_SIZE);
+		}
+		free(starts);
+
+		line->version++;
+		editor_damage_line(te, all[i].line_num);
+		editor_hl_invalidate(te, line, all[i].line_num);
+		i = j;
+	}
+
+	// Joins go bottom up so the line numbers above each one stay valid
+	for (int i = count - 1; i >= 0; i--) {
+		LineNode* line = all[i].line;
+		if (!at_start[i] || !line->prev) continue;
+
+		LineNode* prev_line = line->prev;
+		int prev_size = line_gb(prev_line)->logical_size;
+		editor_join_line(te, prev_line, all[i].line_num - 1);
+
+		for (int k = i; k < count; k++) {
+			if (all[k].line == line) {
+				all[k].line = prev_line;
+				all[k].pos += prev_size;
+			}
+			all[k].line_num--;
+		}
+	}
+	free(at_start);
+
+	te->dirty = 1;
+	editor_scatter_cursors(te, all, count);
+	if (te->cursor_line_num < te->row_offset) te->row_offset = te->cursor_line_num;
+	editor_scroll_to_cursor(te);
+}
+
+// Split the line at every cursor, bottom up so line numbers above stay valid
+void editor_multi_newline(TextEditor* te){
+	int count;
+	Cursor* all = editor_gather_cursors(te, &count);
+
+	for (int i = count - 1; i >= 0; i--) {
+		editor_journal(te, J_SPLIT, all[i].line_num, all[i].pos, NULL, 0);
+		editor_hl_invalidate(te, all[i].line, all[i].line_num);
+		all[i].line = editor_split_line(te, all[i].line, all[i].line_num, all[i].pos);
+	}
+
+	// Every split above a cursor pushes it down one more line
+	for (int i = 0; i < count; i++) {
+		all[i].line_num += i + 1;
+		all[i].pos = 0;
+	}
+
+	editor_scatter_cursors(te, all, count);
+	te->col_offset = 0;
+	if (te->cursor_line_num >= te->row_offset + te->term_height) {
+		te->row_offset = te->cursor_line_num - te->term_height + 1;
+	}
+}
+
+// Arrow keys move the extra cursors the same way the primary one moves
+void editor_multi_move(TextEditor* te, char dir){
+	for (int i = 0; i < te->cursor_count; i++) {
+		Cursor* cur = &te->cursors[i];
+		editor_damage_line(te, cur->line_num);
+
+		if (dir == 'A' || dir == 'B') {
+			LineNode* goal = dir == 'A' ? cur->line->prev : cur->line->next;
+			if (!goal) continue;
+			int col = line_col_of(cur->line, cur->pos);
+			line_gb(goal);
+			cur->pos = line_pos_of_col(goal, col);
+			cur->line = goal;
+			cur->line_num += dir == 'A' ? -1 : 1;
+		} else if (dir == 'C') {
+			cur->pos = line_next_char(cur->line, cur->pos);
+		} else if (dir == 'D') {
+			cur->pos = line_prev_char(cur->line, cur->pos);
+		}
+
+		editor_damage_line(te, cur->line_num);
+	}
+}
+
+// Replace-all. The lines are cut into chunks of REPLACE_CHUNK_LINES that worker
+// threads scan in parallel, reading cold blocks without thawing them. A line that
+// matches gets its new text built in one pass; lines without a match are not touched.
+// The main thread waits for the scan, then swaps the new texts in as one undo step.
+
+#define REPLACE_CHUNK_LINES 16384
+#define REPLACE_MAX_THREADS 16
+
+typedef struct {
+	LineNode* first;
+	int first_line;
+	int count;
+
+	// Lines that matched, in order, with their new text
+	LineNode** lines;
+	int* line_nums;
+	char** texts;
+	int* sizes;
+	int found;
+	int cap;
+	long matches;
+} ReplaceChunk;
+
+typedef struct {
+	ReplaceChunk* chunks;
+	int chunk_count;
+	int next_chunk;
+	pthread_mutex_t lock;       // Guards next_chunk
+	const char* find;
+	int find_len;
+	const char* repl;
+	int repl_len;
+} ReplaceWork;
+
+// Offset of the first match of find in text at or after from, -1 if there is none
+int find_in(const char* text, int len, int from, const char* find, int find_len){
+	while (from + find_len <= len) {
+		const char* hit = memchr(text + from, find[0], len - find_len + 1 - from);
+		if (!hit) return -1;
+		from = hit - text;
+		if (memcmp(hit, find, find_len) == 0) return from;
+		from++;
+	}
+	return -1;
+}
+
+// Build the replaced text of one line if find occurs in it
+void replace_scan_line(ReplaceWork* w, ReplaceChunk* c, LineNode* line, int line_num, const char* text, int len){
+	int matches = 0;
+	for (int at = find_in(text, len, 0, w->find, w->find_len); at >= 0; at = find_in(text, len, at + w->find_len, w->find, w->find_len)) {
+		matches++;
+	}
+	if (matches == 0) return;
+
+	int size = len + matches * (w->repl_len - w->find_len);
+	char* out = malloc(size + INIT_GAP_SIZE);
+	if (!out) {
+		perror("malloc");
+		exit(1);
+	}
+	int src = 0;
+	int dst = 0;
+	for (int at = find_in(text, len, 0, w->find, w->find_len); at >= 0; at = find_in(text, len, src, w->find, w->find_len)) {
+		memcpy(out + dst, text + src, at - src);
+		dst += at - src;
+		memcpy(out + dst, w->repl, w->repl_len);
+		dst += w->repl_len;
+		src = at + w->find_len;
+	}
+	memcpy(out + dst, text + src, len - src);
+
+	if (c->found == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 64;
+		c->lines = realloc(c->lines, sizeof(LineNode*) * c->cap);
+		c->line_nums = realloc(c->line_nums, sizeof(int) * c->cap);
+		c->texts = realloc(c->texts, sizeof(char*) * c->cap);
+		c->sizes = realloc(c->sizes, sizeof(int) * c->cap);
+		if (!c->lines || !c->line_nums || !c->texts || !c->sizes) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	c->lines[c->found] = line;
+	c->line_nums[c->found] = line_num;
+	c->texts[c->found] = out;
+	c->sizes[c->found] = size;
+	c->found++;
+	c->matches += matches;
+}
+
+// Runs while the main thread waits, so the lines cannot change underneath
+void* replace_worker_main(void* arg){
+	ReplaceWork* w = arg;
+	char* scratch = NULL;
+	int scratch_cap = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		int index = w->next_chunk++;
+		pthread_mutex_unlock(&w->lock);
+		if (index >= w->chunk_count) break;
+
+		ReplaceChunk* c = &w->chunks[index];
+		LineNode* line = c->first;
+		int n = 0;
+		while (n < c->count) {
+			if (line->text) {
+				// The gap only needs closing when it sits inside the text
+				GapBuffer* gb = line->text;
+				const char* text = gb->buffer + (gb->gap_start == 0 ? gb->gap_end : 0);
+				if (gb->gap_start > 0 && gb->gap_start < gb->logical_size) {
+					if (gb->logical_size > scratch_cap) {
+						scratch_cap = gb->logical_size * 2;
+						scratch = realloc(scratch, scratch_cap);
+						if (!scratch) {
+							perror("realloc");
+							exit(1);
+						}
+					}
+					gb_copy_range(gb, 0, gb->logical_size, scratch);
+					text = scratch;
+				}
+				replace_scan_line(w, c, line, c->first_line + n, text, gb->logical_size);
+				line = line->next;
+				n++;
+				continue;
+			}
+
+			// Decode the block once and scan every line of it that is in the chunk
+			ColdBlock* block = line->cold;
+			char* raw = malloc(block->raw_size + 1);
+			if (!raw) {
+				perror("malloc");
+				exit(1);
+			}
+			cold_block_decode(block, raw);
+
+			int offset = 0;
+			for (LineNode* l = block->first; l != line; l = l->next) {
+				offset = (char*)memchr(raw + offset, '\n', block->raw_size - offset) - raw + 1;
+			}
+			while (n < c->count && !line->text && line->cold == block) {
+				char* nl = memchr(raw + offset, '\n', block->raw_size - offset);
+				int end = nl ? nl - raw : block->raw_size;
+				replace_scan_line(w, c, line, c->first_line + n, raw + offset, end - offset);
+				offset = end + 1;
+				line = line->next;
+				n++;
+			}
+			free(raw);
+		}
+	}
+	free(scratch);
+	return NULL;
+}
+
+// Give line a new text, the cursors on it stay within the text and on a character
+void editor_set_line(TextEditor* te, LineNode* line, int line_num, char* text, int size){
+	editor_journal(te, J_SET_LINE, line_num, 0, text, size);
+	GapBuffer* gb = line_gb(line);
+	gb_set_buffer(gb, text, size, size + INIT_GAP_SIZE);
+	line->version++;
+	editor_hl_invalidate(te, line, line_num);
+
+	if (te->cursor_line_ref == line) {
+		if (te->cursor_pos > size) te->cursor_pos = size;
+		while (te->cursor_pos > 0 && te->cursor_pos < size && utf8_is_continuation(gb_char_at(gb, te->cursor_pos))) te->cursor_pos--;
+	}
+	for (int i = 0; i < te->cursor_count; i++) {
+		Cursor* cur = &te->cursors[i];
+		if (cur->line != line) continue;
+		if (cur->pos > size) cur->pos = size;
+		while (cur->pos > 0 && cur->pos < size && utf8_is_continuation(gb_char_at(gb, cur->pos))) cur->pos--;
+	}
+}
+
+// Replace every occurrence of find. Returns the number of replacements
+long editor_replace_all(TextEditor* te, const char* find, int find_len, const char* repl, int repl_len){
+	if (find_len <= 0 || te->line_count == 0) return 0;
+
+	ReplaceWork w;
+	w.chunk_count = (te->line_count + REPLACE_CHUNK_LINES - 1) / REPLACE_CHUNK_LINES;
+	w.chunks = calloc(w.chunk_count, sizeof(ReplaceChunk));
+	if (!w.chunks) {
+		perror("calloc");
+		exit(1);
+	}
+	w.next_chunk = 0;
+	pthread_mutex_init(&w.lock, NULL);
+	w.find = find;
+	w.find_len = find_len;
+	w.repl = repl;
+	w.repl_len = repl_len;
+
+	LineNode* line = te->head;
+	for (int i = 0; i < w.chunk_count; i++) {
+		ReplaceChunk* c = &w.chunks[i];
+		c->first = line;
+		c->first_line = i * REPLACE_CHUNK_LINES;
+		c->count = te->line_count - c->first_line < REPLACE_CHUNK_LINES ? te->line_count - c->first_line : REPLACE_CHUNK_LINES;
+		for (int n = 0; n < c->count; n++) line = line->next;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int thread_count = cpus < 1 ? 1 : cpus > REPLACE_MAX_THREADS ? REPLACE_MAX_THREADS : cpus;
+	if (thread_count > w.chunk_count) thread_count = w.chunk_count;
+
+	// The calling thread takes chunks too, and alone if threads cannot be started
+	pthread_t threads[REPLACE_MAX_THREADS];
+	int started = 0;
+	while (started < thread_count - 1 && pthread_create(&threads[started], NULL, replace_worker_main, &w) == 0) started++;
+	replace_worker_main(&w);
+	for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&w.lock);
+
+	int found = 0;
+	long matches = 0;
+	for (int i = 0; i < w.chunk_count; i++) {
+		found += w.chunks[i].found;
+		matches += w.chunks[i].matches;
+	}
+
+	UndoStep* step = NULL;
+	if (found > 0) {
+		step = malloc(sizeof(UndoStep));
+		if (!step) {
+			perror("malloc");
+			exit(1);
+		}
+		step->lines = malloc(sizeof(LineNode*) * found);
+		step->line_nums = malloc(sizeof(int) * found);
+		step->texts = malloc(sizeof(char*) * found);
+		step->sizes = malloc(sizeof(int) * found);
+		if (!step->lines || !step->line_nums || !step->texts || !step->sizes) {
+			perror("malloc");
+			exit(1);
+		}
+		step->count = 0;
+	}
+
+	for (int i = 0; i < w.chunk_count; i++) {
+		ReplaceChunk* c = &w.chunks[i];
+		for (int k = 0; k < c->found; k++) {
+			GapBuffer* gb = line_gb(c->lines[k]);
+			char* old = malloc(gb->logical_size + INIT_GAP_SIZE);
+			if (!old) {
+				perror("malloc");
+				exit(1);
+			}
+			gb_copy_range(gb, 0, gb->logical_size, old);
+			step->lines[step->count] = c->lines[k];
+			step->line_nums[step->count] = c->line_nums[k];
+			step->texts[step->count] = old;
+			step->sizes[step->count] = gb->logical_size;
+			step->count++;
+
+			editor_set_line(te, c->lines[k], c->line_nums[k], c->texts[k], c->sizes[k]);
+		}
+		free(c->lines);
+		free(c->line_nums);
+		free(c->texts);
+		free(c->sizes);
+	}
+	free(w.chunks);
+
+	if (step) {
+		step->edit_serial = te->hl_edit_serial;
+		step->prev = te->undo;
+		te->undo = step;
+
+		// Keep the newest steps only
+		if (++te->undo_depth > UNDO_MAX_STEPS) {
+			UndoStep* s = te->undo;
+			while (s->prev->prev) s = s->prev;
+			undo_step_free(s->prev);
+			s->prev = NULL;
+			te->undo_depth--;
+		}
+		te->dirty = 1;
+		te->full_redraw = 1;
+	}
+	return matches;
+}
+
+// Take back the last replace-all. Returns 0 if there is none, or the buffer was
+// edited after it in some other way
+int editor_undo(TextEditor* te){
+	UndoStep* step = te->undo;
+	if (!step) return 0;
+	if (step->edit_serial != te->hl_edit_serial) {
+		log_to_file("Buffer edited since the last replace, nothing to undo");
+		editor_undo_clear(te);
+		return 0;
+	}
+
+	for (int i = 0; i < step->count; i++) {
+		editor_set_line(te, step->lines[i], step->line_nums[i], step->texts[i], step->sizes[i]);
+		step->texts[i] = NULL;
+	}
+	te->undo = step->prev;
+	te->undo_depth--;
+	undo_step_free(step);
+
+	// The buffer is back to how the next step left it
+	if (te->undo) te->undo->edit_serial = te->hl_edit_serial;
+	te->dirty = 1;
+	te->full_redraw = 1;
+	return 1;
+}
+
+
+void editor_print_text(TextEditor* te) {
+    LineNode* current = te->head;
+    int line_number = 1;
+
+    while (current != NULL) {
+        printf("Line %d: ", line_number);
+		printf("%s\n", gb_render(line_gb(current)));
+        // gb_print(current->text);
+        current = current->next;
+        line_number++;
+    }
+}
+
+
+// Greedy word wrap. Returns the number of screen rows the text takes at width,
+// filling breaks (when given) with the start offset of every row after the first.
+// cols is the line's column map, NULL for ASCII.
+int wrap_line(const char* text, int len, int* cols, int width, int* breaks){
+	int rows = 1;
+	int row_start = 0;
+	while (1) {
+		int brk;
+		if (!cols) {
+			if (len - row_start <= width) break;
+			brk = row_start + width;
+		} else {
+			int limit = cols[row_start] + width;
+			if (cols[len] <= limit) break;
+
+			// Last character boundary that still fits, at least one character per row
+			brk = row_start;
+			do {
+				int next = brk + 1;
+				while (next < len && utf8_is_continuation(text[next])) next++;
+				if (cols[next] > limit && brk > row_start) break;
+				brk = next;
+			} while (brk < len);
+		}
+
+		// Prefer breaking after the last space in the row
+		for (int i = brk; i > row_start + 1; i--) {
+			if (text[i - 1] == ' ') {
+				brk = i;
+				break;
+			}
+		}
+
+		if (breaks) breaks[rows - 1] = brk;
+		rows++;
+		row_start = brk;
+	}
+	return rows;
+}
+
+int line_wrap_is_exact(TextEditor* te, LineNode* line){
+	return line->wrap_width == te->wrap_width && line->wrap_version == line->version;
+}
+
+void wrap_tree_add(TextEditor* te, int line_num, int delta){
+	for (int i = line_num + 1; i <= te->wrap_tree_lines; i += i & -i) te->wrap_tree[i] += delta;
+}
+
+// Screen rows taken by all lines before line_num
+int wrap_tree_prefix(TextEditor* te, int line_num){
+	int sum = 0;
+	for (int i = line_num; i > 0; i -= i & -i) sum += te->wrap_tree[i];
+	return sum;
+}
+
+// Line containing the given visual row, O(log n)
+int wrap_tree_find(TextEditor* te, int row){
+	int pos = 0;
+	int step = 1;
+	while (step * 2 <= te->wrap_tree_lines) step *= 2;
+
+	for (; step > 0; step /= 2) {
+		if (pos + step <= te->wrap_tree_lines && te->wrap_tree[pos + step] <= row) {
+			pos += step;
+			row -= te->wrap_tree[pos];
+		}
+	}
+	return pos < te->wrap_tree_lines ? pos : te->wrap_tree_lines - 1;
+}
+
+// Rebuild the prefix sums from the cached row counts. Lines are not re-wrapped here:
+// ones wrapped for another width or version are estimated from their length and
+// corrected by editor_wrap_sync_line once they come into view.
+void editor_wrap_prepare(TextEditor* te){
+	int width = editor_text_width(te);
+	if (te->wrap_tree && te->wrap_tree_version == te->structure_version && te->wrap_width == width) return;
+
+	te->wrap_width = width;
+	te->wrap_tree_lines = te->line_count;
+	te->wrap_tree_version = te->structure_version;
+	te->wrap_tree = realloc(te->wrap_tree, sizeof(int) * (te->line_count + 1));
+	te->wrap_tree[0] = 0;
+
+	int i = 1;
+	for (LineNode* line = te->head; line != NULL; line = line->next, i++) {
+		if (!line_wrap_is_exact(te, line) && line->text) {
+			int len = line->text->logical_size;
+			line->wrap_rows = len > width ? (len + width - 1) / width : 1;
+		}
+		te->wrap_tree[i] = line->wrap_rows;
+	}
+
+	// Linear time Fenwick construction
+	for (i = 1; i <= te->wrap_tree_lines; i++) {
+		int parent = i + (i & -i);
+		if (parent <= te->wrap_tree_lines) te->wrap_tree[parent] += te->wrap_tree[i];
+	}
+}
+
+// Giant lines break at fixed columns instead of at spaces. Rows come straight from the
+// WidthIndex, so only the rows on screen are ever looked at. A row starts with the first
+// character at or after its column; one column is left over so a wide character
+// starting on the row's last column still fits
+int long_line_wrap_stride(int width){
+	return width > 1 ? width - 1 : 1;
+}
+
+int long_line_wrap_rows(LineNode* line, int width){
+	GapBuffer* gb = line_gb(line);
+	int cols = gb_col_of(gb, gb->logical_size);
+	int stride = long_line_wrap_stride(width);
+	return cols > stride ? (cols + stride - 1) / stride : 1;
+}
+
+int long_line_row_start(LineNode* line, int row, int width){
+	return row > 0 ? gb_pos_of_col(line_gb(line), row * long_line_wrap_stride(width)) : 0;
+}
+
+// Re-wrap a single line if its cache is stale and fold the difference into the tree
+int editor_wrap_sync_line(TextEditor* te, LineNode* line, int line_num){
+	if (line_wrap_is_exact(te, line)) return line->wrap_rows;
+
+	int rows;
+	if (line_is_long(line)) {
+		rows = long_line_wrap_rows(line, te->wrap_width);
+	} else {
+		char* text = gb_render(line_gb(line));
+		rows = wrap_line(text, line->text->logical_size, line_col_map(line), te->wrap_width, NULL);
+		free(text);
+	}
+
+	wrap_tree_add(te, line_num, rows - line->wrap_rows);
+	line->wrap_rows = rows;
+	line->wrap_width = te->wrap_width;
+	line->wrap_version = line->version;
+	return rows;
+}
+
+// Row within line, and column within that row, where pos sits
+void editor_wrap_pos(TextEditor* te, LineNode* line, int line_num, int pos, int* row, int* col){
+	int rows = editor_wrap_sync_line(te, line, line_num);
+	if (line_is_long(line)) {
+		int pos_col = gb_col_of(line_gb(line), pos);
+		int r = pos_col / long_line_wrap_stride(te->wrap_width);
+		if (r >= rows) r = rows - 1;
+		*row = r;
+		*col = pos_col - gb_col_of(line_gb(line), long_line_row_start(line, r, te->wrap_width));
+		return;
+	}
+
+	int* breaks = malloc(sizeof(int) * rows);
+	int* cols = line_col_map(line);
+	char* text = gb_render(line_gb(line));
+	wrap_line(text, line->text->logical_size, cols, te->wrap_width, breaks);
+	free(text);
+
+	int r = 0;
+	while (r < rows - 1 && breaks[r] <= pos) r++;
+	int row_start = r > 0 ? breaks[r - 1] : 0;
+	*row = r;
+	*col = cols ? cols[pos] - cols[row_start] : pos - row_start;
+	free(breaks);
+}
+
+void editor_wrap_cursor(TextEditor* te, int* row, int* col){
+	editor_wrap_pos(te, te->cursor_line_ref, te->cursor_line_num, te->cursor_pos, row, col);
+}
+
+// Keep the cursor on screen. Syncing the visible lines can change row counts above
+// the cursor, so this settles after at most a couple of passes.
+void editor_wrap_scroll(TextEditor* te){
+	for (int pass = 0; pass < 3; pass++) {
+		int cursor_row, cursor_col;
+		editor_wrap_cursor(te, &cursor_row, &cursor_col);
+		cursor_row += wrap_tree_prefix(te, te->cursor_line_num);
+
+		int top = te->wrap_top_row;
+		if (cursor_row < top) top = cursor_row;
+		if (cursor_row >= top + te->term_height) top = cursor_row - te->term_height + 1;
+
+		// Sync what is about to be drawn
+		int line_num = wrap_tree_find(te, top);
+		LineNode* line = editor_line_at(te, line_num);
+		int filled = 0;
+		while (line && filled < te->term_height) {
+			filled += editor_wrap_sync_line(te, line, line_num);
+			line = line->next;
+			line_num++;
+		}
+
+		if (top == te->wrap_top_row && pass > 0) break;
+		te->wrap_top_row = top;
+	}
+
+	te->row_offset = wrap_tree_find(te, te->wrap_top_row);
+}
+
+void editor_toggle_soft_wrap(TextEditor* te){
+	te->soft_wrap = !te->soft_wrap;
+
+	if (te->soft_wrap) {
+		te->col_offset = 0;
+		editor_wrap_prepare(te);
+		te->wrap_top_row = wrap_tree_prefix(te, te->row_offset);
+	} else {
+		// Back to horizontal scrolling, keep the cursor in view
+		te->col_offset = 0;
+		editor_scroll_to_cursor(te);
+		if (te->cursor_line_num >= te->row_offset + te->term_height) {
+			te->row_offset = te->cursor_line_num - te->term_height + 1;
+		}
+	}
+}
+
+
+void ob_append_color(OutBuffer* ob, HighlightType type){
+	switch (type) {
+		case HL_KEYWORD:
+			ob_append(ob, "\033[1;32m", 7); // Green
+			break;
+		case HL_STRING:
+			ob_append(ob, "\033[1;33m", 7); // Yellow
+			break;
+		case HL_COMMENT:
+			ob_append(ob, "\033[1;30m", 7); // Gray
+			break;
+		case HL_NUMBER:
+			ob_append(ob, "\033[1;31m", 7); // Red
+			break;
+		default:
+			ob_append(ob, "\033[0m", 4); // Reset
+			break;
+	}
+}
+
+void editor_add_highlight(OutBuffer* ob, HighlightType type, char c){
+	ob_append_color(ob, type);
+
+        ob_append(ob, &c, 1); // Add the character
+        ob_append(ob, "\033[0m", 4);    // Reset after each character
+}
+
+// Append text[start, end) switching colour only where the highlight class changes
+void ob_append_highlighted(OutBuffer* ob, const char* text, const unsigned char* hl, int start, int end){
+	int i = start;
+	while (i < end) {
+		int run = i + 1;
+		while (run < end && hl[run] == hl[i]) run++;
+
+		if (hl[i] != HL_NORMAL) ob_append_color(ob, hl[i]);
+		ob_append(ob, (char*)text + i, run - i);
+		if (hl[i] != HL_NORMAL) ob_append(ob, "\033[0m", 4);
+		i = run;
+	}
+}
+
+// Highlight classes for a line, computed into the editor's scratch buffers (the line's
+// text is left in hl_text). Only the line itself is lexed, from the start state the
+// background worker found for it; NULL when there is none yet or no syntax
+unsigned char* editor_highlight_line(TextEditor* te, LineNode* line){
+	if (!te->syntax || !line->hl_known) return NULL;
+
+	// Lexing a giant line would cost all of it every frame, so it is drawn plain
+	GapBuffer* gb = line_gb(line);
+	int len = gb->logical_size;
+	if (len >= LONG_LINE_BYTES) return NULL;
+	if (len + 1 > te->hl_cap) {
+		te->hl_cap = (len + 1) * 2;
+		te->hl_text = realloc(te->hl_text, te->hl_cap);
+		te->hl_buf = realloc(te->hl_buf, te->hl_cap);
+		if (!te->hl_text || !te->hl_buf) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	gb_copy_range(gb, 0, len, te->hl_text);
+
+	highlight_line(te->syntax, te->hl_text, len, te->hl_buf, line->hl_state_in);
+	return te->hl_buf;
+}
+
+void editor_render_line(TextEditor* te, OutBuffer* ob, LineNode* line){
+        // Render the line text straight from the gap buffer
+		GapBuffer* gb = line_gb(line);
+		unsigned char* hl = editor_highlight_line(te, line);
+		int line_length = gb->logical_size;
+		int long_line = line_is_long(line);
+		int* col_map = long_line ? NULL : line_col_map(line);
+		int line_cols = col_map ? col_map[line_length] : long_line ? gb_col_of(gb, line_length) : line_length;
+
+		// Outside visible range
+		if(line_cols < te->col_offset){
+			return;
+		}
+
+
+        // Only render the visible range
+		int render_start = te->col_offset;
+		int render_length = (line_length - render_start > te->term_width - te->line_number_width)
+								? te->term_width - te->line_number_width
+								: line_length - render_start;
+
+		// Multibyte and giant lines: clip by display columns, never splitting a character
+		if (col_map || long_line) {
+			int text_width = editor_text_width(te);
+			render_start = line_pos_of_col(line, te->col_offset);
+			int render_end = render_start;
+			int col = line_col_of(line, render_start);
+			while (render_end < line_length) {
+				int next = line_char_end(line, render_end);
+				int next_col = col_map ? col_map[next] : col + gb_span_width(gb, gb_physical(gb, render_end), gb_physical(gb, next));
+				if (next_col - te->col_offset > text_width) break;
+				render_end = next;
+				col = next_col;
+			}
+			render_length = render_end - render_start;
+		}
+		//
+		// for(int i = 0; i < render_length; i++){
+		// 	char curr_char = line_text[render_start + i];
+		//
+		//
+		//
+  //           if (curr_char == '"') {
+  //               // Start of a string
+  //               editor_add_highlight(ob, HL_STRING, curr_char);
+		// 		i++; // Move to the next character
+		// 		// Parse the string
+		// 		while (i < render_length) {
+		// 			curr_char = line_text[render_start + i];
+		//
+		// 			 if (curr_char == '"') {
+		// 				editor_add_highlight(ob, HL_STRING, curr_char); // Highlight closing quote
+		// 				break; // End of string
+		// 			} else {
+		// 				editor_add_highlight(ob, HL_STRING, curr_char); // Highlight string content
+		// 			}
+		//
+		// 			i++;
+		// 		}
+  //           } else {
+  //               // Handle other types of syntax highlighting (e.g., keywords, numbers)
+		// 		 if (isdigit(curr_char)) {
+  //                   editor_add_highlight(ob, HL_NUMBER, curr_char);
+  //               } else {
+  //                   editor_add_highlight(ob, HL_NORMAL, curr_char);
+  //               }
+  //           }
+		// }
+
+		if (hl) {
+			ob_append_highlighted(ob, te->hl_text, hl, render_start, render_start + render_length);
+			return;
+		}
+		ob_reserve(ob, render_length);
+		gb_copy_range(gb, render_start, render_length, ob->buffer + ob->size);
+		ob->size += render_length;
+}
+
+
+#define MOVE_HOME "\033[H"
+#define CLEAR_HOME "\033[H\033[2J"
+#define NEW_LINE "\033[1E"
+#define CLEAR_LINE "\033[K"
+#define LINE_NUM_CURRENT "\033[93;1m" // Bright yellow, bold
+#define LINE_NUM_OTHER "\033[90m" // Dark gray
+void editor_render_line_number(TextEditor* te, OutBuffer* ob, int line_num){
+	char editor_line_num[32];
+	int n = 0;
+
+	if (line_num == te->cursor_line_num) {
+		memcpy(editor_line_num, LINE_NUM_CURRENT, sizeof(LINE_NUM_CURRENT) - 1);
+		n = sizeof(LINE_NUM_CURRENT) - 1;
+	} else {
+		memcpy(editor_line_num, LINE_NUM_OTHER, sizeof(LINE_NUM_OTHER) - 1);
+		n = sizeof(LINE_NUM_OTHER) - 1;
+	}
+	n += fmt_uint(editor_line_num + n, line_num + 1, 4);
+	memcpy(editor_line_num + n, " \033[0m", 5);
+	ob_append(ob, editor_line_num, n + 5);
+}
+
+// Draw the character under cur (a space past the end) in reverse video at row, col on screen
+void editor_render_cursor_cell(TextEditor* te, OutBuffer* ob, Cursor* cur, int row, int col){
+	ob_append_cursor_move(ob, row + 1, col + te->line_number_width + 1);
+	ob_append(ob, "\033[7m", 4);
+
+	GapBuffer* gb = cur->line->text;
+	if (cur->pos < gb->logical_size) {
+		char ch[4];
+		int end = line_char_end(cur->line, cur->pos);
+		int size = end - cur->pos < (int)sizeof(ch) ? end - cur->pos : (int)sizeof(ch);
+		gb_copy_range(gb, cur->pos, size, ch);
+		ob_append(ob, ch, size);
+	} else {
+		ob_append(ob, " ", 1);
+	}
+	ob_append(ob, "\033[27m", 5);
+}
+
+// Extra cursors are drawn as reverse video cells, the terminal cursor marks the primary
+void editor_render_extra_cursors(TextEditor* te, OutBuffer* ob){
+	int width = editor_text_width(te);
+	for (int i = 0; i < te->cursor_count; i++) {
+		Cursor* cur = &te->cursors[i];
+		int row = cur->line_num - te->row_offset;
+		int col = line_col_of(cur->line, cur->pos) - te->col_offset;
+		if (row < 0 || row >= te->term_height || col < 0 || col >= width) continue;
+		editor_render_cursor_cell(te, ob, cur, row, col);
+	}
+}
+
+// Same for soft wrap, where a cursor's screen row depends on how the rows above it wrap
+void editor_render_extra_cursors_wrapped(TextEditor* te, OutBuffer* ob){
+	for (int i = 0; i < te->cursor_count; i++) {
+		Cursor* cur = &te->cursors[i];
+		if (cur->line_num < te->row_offset) continue;
+		int top = wrap_tree_prefix(te, cur->line_num) - te->wrap_top_row;
+		if (top >= te->term_height) continue;
+
+		int row, col;
+		editor_wrap_pos(te, cur->line, cur->line_num, cur->pos, &row, &col);
+		row += top;
+		if (row < 0 || row >= te->term_height) continue;
+		editor_render_cursor_cell(te, ob, cur, row, col);
+	}
+}
+
+// The visible rows of a giant line, copied out one row at a time. Returns the next screen row
+int editor_render_long_wrapped(TextEditor* te, OutBuffer* ob, LineNode* line, int line_num, int rows, int skip_rows, int screen_row){
+	GapBuffer* gb = line_gb(line);
+	int start = long_line_row_start(line, skip_rows, te->wrap_width);
+	for (int r = skip_rows; r < rows && screen_row < te->term_height; r++, screen_row++) {
+		ob_append_cursor_move(ob, screen_row + 1, 1);
+		ob_append(ob, CLEAR_LINE, strlen(CLEAR_LINE));
+		if (r == 0) {
+			editor_render_line_number(te, ob, line_num);
+		} else {
+			ob_append(ob, "     ", te->line_number_width);
+		}
+
+		int end = r < rows - 1 ? long_line_row_start(line, r + 1, te->wrap_width) : gb->logical_size;
+		ob_reserve(ob, end - start);
+		gb_copy_range(gb, start, end - start, ob->buffer + ob->size);
+		ob->size += end - start;
+		start = end;
+	}
+	return screen_row;
+}
+
+// Soft wrap: each line takes as many rows as wrap_line gives it, numbered on the first
+void editor_render_wrapped(TextEditor* te, OutBuffer* ob){
+	editor_wrap_prepare(te);
+	editor_wrap_scroll(te);
+
+	int line_num = te->row_offset;
+	int skip_rows = te->wrap_top_row - wrap_tree_prefix(te, line_num);
+	LineNode* line = editor_line_at(te, line_num);
+	int screen_row = 0;
+
+	while (line && screen_row < te->term_height) {
+		GapBuffer* gb = line_gb(line);
+		int rows = editor_wrap_sync_line(te, line, line_num);
+		if (line_is_long(line)) {
+			screen_row = editor_render_long_wrapped(te, ob, line, line_num, rows, skip_rows, screen_row);
+			skip_rows = 0;
+			line = line->next;
+			line_num++;
+			continue;
+		}
+
+		int* breaks = malloc(sizeof(int) * rows);
+		char* text = gb_render(gb);
+		unsigned char* hl = editor_highlight_line(te, line);
+		wrap_line(text, gb->logical_size, line_col_map(line), te->wrap_width, breaks);
+
+		for (int r = skip_rows; r < rows && screen_row < te->term_height; r++, screen_row++) {
+			ob_append_cursor_move(ob, screen_row + 1, 1);
+			ob_append(ob, CLEAR_LINE, strlen(CLEAR_LINE));
+
+			if (r == 0) {
+				editor_render_line_number(te, ob, line_num);
+			} else {
+				ob_append(ob, "     ", te->line_number_width);
+			}
+
+			int start = r > 0 ? breaks[r - 1] : 0;
+			int end = r < rows - 1 ? breaks[r] : gb->logical_size;
+			if (hl) ob_append_highlighted(ob, text, hl, start, end);
+			else ob_append(ob, text + start, end - start);
+		}
+
+		free(text);
+		free(breaks);
+		skip_rows = 0;
+		line = line->next;
+		line_num++;
+	}
+
+	// Clear rows past the end of the file
+	for (; screen_row < te->term_height; screen_row++) {
+		ob_append_cursor_move(ob, screen_row + 1, 1);
+		ob_append(ob, CLEAR_LINE, strlen(CLEAR_LINE));
+	}
+
+	editor_render_extra_cursors_wrapped(te, ob);
+
+	int cursor_row, cursor_col;
+	editor_wrap_cursor(te, &cursor_row, &cursor_col);
+	cursor_row += wrap_tree_prefix(te, te->cursor_line_num) - te->wrap_top_row;
+
+	ob_append_cursor_move(ob, cursor_row + 1, cursor_col + te->line_number_width + 1);
+}
+
+// Scroll the screen contents by delta rows inside a DECSTBM region covering the
+// text rows above the bottom one, which the prompt draws over and so is left alone
+// and redrawn. Only the rows scrolled into view need to be drawn.
+void editor_render_scroll(TextEditor* te, OutBuffer* ob, int delta){
+	int region = te->term_height - 1;
+	char seq[48];
+	int n = 0;
+	memcpy(seq, "\033[1;", 4);
+	n = 4;
+	n += fmt_uint(seq + n, region, 0);
+	memcpy(seq + n, "r\033[", 3);
+	n += 3;
+	n += fmt_uint(seq + n, delta > 0 ? delta : -delta, 0);
+	seq[n++] = delta > 0 ? 'S' : 'T';
+	memcpy(seq + n, "\033[r", 3);
+	n += 3;
+	ob_append(ob, seq, n);
+
+	// Damage follows its line, exposed rows are new
+	if (delta > 0) {
+		memmove(te->row_damage, te->row_damage + delta, region - delta);
+		memset(te->row_damage + region - delta, 1, delta);
+	} else {
+		memmove(te->row_damage - delta, te->row_damage, region + delta);
+		memset(te->row_damage, 1, -delta);
+	}
+	te->row_damage[region] = 1;
+}
+
+// Draw the open prompt over the bottom row and leave the terminal cursor at its end
+void editor_render_prompt(TextEditor* te, OutBuffer* ob){
+	if (te->prompt == PROMPT_NONE) return;
+	char* label = te->prompt == PROMPT_FIND ? "Replace: " : "With: ";
+	int label_len = strlen(label);
+
+	// Only the end of a long text fits
+	int room = te->term_width - label_len - 1;
+	int start = 0;
+	int cols = 0;
+	for (int i = te->prompt_len - 1; i >= 0; i--) {
+		if (utf8_is_continuation(te->prompt_text[i])) continue;
+		if (cols == room) {
+			start = i + 1;
+			while (start < te->prompt_len && utf8_is_continuation(te->prompt_text[start])) start++;
+			break;
+		}
+		cols++;
+	}
+
+	ob_append_cursor_move(ob, te->term_height, 1);
+	ob_append(ob, CLEAR_LINE, strlen(CLEAR_LINE));
+	ob_append(ob, label, label_len);
+	ob_append(ob, te->prompt_text + start, te->prompt_len - start);
+	ob_append_cursor_move(ob, te->term_height, label_len + cols + 1);
+
+	// Repaint the text underneath once the prompt goes away
+	if (te->term_height <= te->damage_rows) te->row_damage[te->term_height - 1] = 1;
+}
+
+void editor_render(TextEditor* te){
+
+	// The frame buffer lives as long as the editor and is sized for the screen once
+    OutBuffer* ob = &te->frame;
+	ob->size = 0;
+	ob_fit_screen(ob, te->term_height, te->term_width);
+
+    // Set the cursor type to vertical bar 
+    ob_append(ob, "\033[5 q", strlen("\033[5 q"));
+
+	if (te->soft_wrap) {
+		editor_render_wrapped(te, ob);
+		editor_render_prompt(te, ob);
+		editor_write(te, ob->buffer, ob->size);
+		te->full_redraw = 1;
+		return;
+	}
+
+	// Anything that shifts the view repaints every row, otherwise only damaged ones.
+	// A plain vertical scroll moves the rows on screen and draws just the exposed ones
+	editor_damage_line(te, te->cursor_line_num); // Makes sure the damage map fits the screen
+	int scroll = te->row_offset - te->last_row_offset;
+	int full = te->full_redraw ||
+			   te->col_offset != te->last_col_offset ||
+			   te->line_count != te->last_line_count ||
+			   (scroll != 0 && (scroll >= te->term_height - 1 || -scroll >= te->term_height - 1));
+	if (!full && scroll != 0) editor_render_scroll(te, ob, scroll);
+	te->last_row_offset = te->row_offset;
+
+	// The old and new cursor lines change their line number colour
+	editor_damage_line(te, te->last_cursor_line);
+	editor_damage_line(te, te->cursor_line_num);
+	
+    LineNode* current = editor_line_at(te, te->row_offset);
+    int current_line_num = te->row_offset;
+    int visible_lines = 0;
+
+    while (current != NULL && visible_lines < te->term_height) {
+		if (!full && !te->row_damage[visible_lines]) {
+			current = current->next;
+			current_line_num++;
+			visible_lines++;
+			continue;
+		}
+
+        // Move cursor to the start of the line
+        ob_append_cursor_move(ob, visible_lines + 1, 1);
+
+        // Clear the line
+        ob_append(ob, CLEAR_LINE, strlen(CLEAR_LINE));
+
+		// Add line number to editor 
+		editor_render_line_number(te, ob, current_line_num);
+
+  //       // Render the line text
+  //       char* line_text = gb_render(current->text);
+		// int line_length = strlen(line_text);
+		//
+  //       // Calculate the visible range
+  //       if (te->col_offset < line_length) {
+  //           int render_start = te->col_offset;
+  //           int render_length = (line_length - render_start > te->term_width - te->line_number_width)
+  //                                   ? te->term_width - te->line_number_width
+  //                                   : line_length - render_start;
+  //           ob_append(&ob, line_text + render_start, render_length);
+  //       }
+		//
+  //       free(line_text);
+
+		editor_render_line(te, ob, current);
+
+        current = current->next;
+        current_line_num++;
+		visible_lines++;
+	}
+
+	// Clear rows past the end of the file
+	for (; full && visible_lines < te->term_height; visible_lines++) {
+        ob_append_cursor_move(ob, visible_lines + 1, 1);
+        ob_append(ob, CLEAR_LINE, strlen(CLEAR_LINE));
+	}
+
+	editor_render_extra_cursors(te, ob);
+
+	memset(te->row_damage, 0, te->damage_rows);
+	te->full_redraw = 0;
+	te->last_col_offset = te->col_offset;
+	te->last_line_count = te->line_count;
+	te->last_cursor_line = te->cursor_line_num;
+
+    // Set cursor position
+    int adjusted_cursor_row = te->cursor_line_num - te->row_offset + 1;
+    int adjusted_cursor_col = line_col_of(te->cursor_line_ref, te->cursor_pos) - te->col_offset + te->line_number_width + 1;
+    ob_append_cursor_move(ob, adjusted_cursor_row, adjusted_cursor_col);
+
+
+	editor_render_prompt(te, ob);
+
+    // Write the buffer to the terminal
+    editor_write(te, ob->buffer, ob->size);
+
+
+}
+
+
+// Buffers, lines and line offsets are all sized with ints
+#define FILE_MAX_BYTES (INT_MAX - 1L)
+
+char* read_file_to_str(const char *filename, long* out_size) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Error opening file");
+        return NULL;
+    }
+
+    // Seek to the end of the file to determine its size
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    if (fileSize > FILE_MAX_BYTES) {
+        fprintf(stderr, "%s: files over %ld MB are not supported\n", filename, FILE_MAX_BYTES >> 20);
+        fclose(file);
+        return NULL;
+    }
+
+    // Seek back to the beginning of the file
+    fseek(file, 0, SEEK_SET);
+
+    char *buffer = (char*)malloc((fileSize + 1) * sizeof(char));
+    if (buffer == NULL) {
+        perror("Error allocating memory");
+        fclose(file);
+        return NULL;
+    }
+
+    // Read the file content into the buffer
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    if (bytesRead != fileSize) {
+        perror("Error reading file");
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+
+    buffer[fileSize] = '\0';
+	if (out_size) *out_size = fileSize;
+
+    fclose(file);
+    return buffer;
+}
+
+
+// Line hashes are compared a block at a time so unchanged stretches are skipped with memcmp
+#define RELOAD_BLOCK_LINES 64
+
+// Split text into lines, returning the start offset of every line (plus one past the end)
+int* split_lines(char* text, long text_size, int* line_count){
+	int cap = 1024;
+	int count = 0;
+	int* starts = malloc(sizeof(int) * cap);
+
+	long pos = 0;
+	starts[count++] = 0;
+	while (pos <= text_size) {
+		char* nl = memchr(text + pos, '\n', text_size - pos);
+		long line_end = nl ? nl - text : text_size;
+
+		if (count + 1 >= cap) {
+			cap *= 2;
+			starts = realloc(starts, sizeof(int) * cap);
+		}
+		starts[count++] = line_end + 1;
+		pos = line_end + 1;
+	}
+
+	// Last entry is the sentinel, not a line
+	*line_count = count - 1;
+	return starts;
+}
+
+uint32_t* hash_lines(char* text, int* starts, int line_count){
+	uint32_t* hashes = malloc(sizeof(uint32_t) * (line_count > 0 ? line_count : 1));
+	for (int i = 0; i < line_count; i++) {
+		hashes[i] = hash_bytes(text + starts[i], starts[i + 1] - starts[i] - 1);
+	}
+	return hashes;
+}
+
+void editor_replace_line_text(LineNode* line, char* text, int text_size){
+	LineNode* fresh = line_create(text, text_size);
+	line_gb(line);
+	gb_free(line->text);
+	free(line->text);
+	line->text = fresh->text;
+	line->version++;
+	free(fresh);
+}
+
+// Also called again to re-arm the watch when follow mode is toggled
+void editor_watch_file(TextEditor* te){
+	if (!te->filename) return;
+
+	if (te->watch_fd < 0) te->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (te->watch_fd < 0) return;
+
+	// Watch the directory rather than the file so atomic rename-over saves are seen too
+	char dir[4096];
+	const char* slash = strrchr(te->filename, '/');
+	if (slash) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - te->filename), te->filename);
+		if (dir[0] == '\0') strcpy(dir, "/");
+	} else {
+		strcpy(dir, ".");
+	}
+
+	// Loggers append without ever closing the file, so following needs every write
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO;
+	if (te->follow) mask |= IN_MODIFY;
+	te->watch_wd = inotify_add_watch(te->watch_fd, dir, mask);
+	if (te->watch_wd < 0) {
+		close(te->watch_fd);
+		te->watch_fd = -1;
+	}
+}
+
+// Read te->filename into a fresh line list and record the on-disk line hashes
+void editor_free_lines(TextEditor* te){
+	LineNode* current = te->head;
+	while (current != NULL) {
+		LineNode* next = current->next;
+		line_free(current);
+		current = next;
+	}
+	te->head = NULL;
+	te->cursor_line_ref = NULL;
+	te->line_count = 0;
+	te->cursor_count = 0;
+	te->structure_version++;
+	editor_hl_reset(te);
+	editor_undo_clear(te);
+}
+
+// The whole buffer as one string, every line followed by '\n'. Returns NULL when out of memory
+char* editor_pack_text(TextEditor* te, long* out_size){
+	// A cold block is already '\n' joined, so it is decoded straight into place
+	long packed_size = 0;
+	for (LineNode* line = te->head; line != NULL; line = line->next) {
+		if (line->text) packed_size += line->text->logical_size + 1;
+		else if (line == line->cold->first) packed_size += line->cold->raw_size + 1;
+	}
+
+	char* packed = malloc(packed_size > 0 ? packed_size : 1);
+	if (!packed) return NULL;
+
+	long offset = 0;
+	for (LineNode* line = te->head; line != NULL; line = line->next) {
+		if (!line->text) {
+			if (line != line->cold->first) continue;
+			cold_block_decode(line->cold, packed + offset);
+			offset += line->cold->raw_size;
+			packed[offset++] = '\n';
+			continue;
+		}
+
+		GapBuffer* gb = line->text;
+		int after_gap = gb->logical_size - gb->gap_start;
+		memcpy(packed + offset, gb->buffer, gb->gap_start);
+		memcpy(packed + offset + gb->gap_start, gb->buffer + gb->gap_end, after_gap);
+		offset += gb->logical_size;
+		packed[offset++] = '\n';
+	}
+
+	*out_size = packed_size;
+	return packed;
+}
+
+// Remember how much of which file the buffer holds, for follow mode
+void editor_note_disk_file(TextEditor* te, long size){
+	struct stat st;
+	te->disk_size = size;
+	te->disk_ino = stat(te->filename, &st) == 0 ? st.st_ino : 0;
+}
+
+int editor_load_file(TextEditor* te){
+	long text_size = 0;
+	char* text = read_file_to_str(te->filename, &text_size);
+	if (!text) return 0;
+
+	JournalHeader old_base = te->journal_base;
+	ino_t old_ino = te->disk_ino;
+	editor_set_text(te, text, text_size);
+	journal_header_for(te->filename, &te->journal_base);
+	editor_note_disk_file(te, text_size);
+
+	// Hashes kept while the buffer was compacted hold as long as the file is the same
+	if (!te->disk_line_hashes || te->disk_ino != old_ino ||
+		memcmp(&old_base, &te->journal_base, sizeof(JournalHeader)) != 0) {
+		free(te->disk_line_hashes);
+		int* starts = split_lines(text, text_size, &te->disk_line_count);
+		te->disk_line_hashes = hash_lines(text, starts, te->disk_line_count);
+		free(starts);
+	}
+	free(text);
+	return 1;
+}
+
+// Redo one journaled edit. Returns 0 if it does not fit the buffer, which means the
+// record is damaged and nothing after it can be trusted either
+int editor_journal_apply(TextEditor* te, const JournalRecord* rec, char* payload){
+	if (rec->op == J_RESET) {
+		if (rec->len < 1) return 0;
+		editor_free_lines(te);
+		editor_set_text(te, payload, rec->len - 1);
+		editor_set_cursor_to_first_line(te);
+		te->dirty = 1;
+		return 1;
+	}
+
+	if (rec->line >= (uint32_t)te->line_count) return 0;
+	LineNode* line = editor_line_at(te, rec->line);
+	GapBuffer* gb = line_gb(line);
+	if (rec->pos > (uint32_t)gb->logical_size) return 0;
+
+	// Park the cursor on the edit so the next lookup walks from here
+	te->cursor_line_ref = line;
+	te->cursor_line_num = rec->line;
+	te->cursor_pos = rec->pos;
+	editor_hl_invalidate(te, line, rec->line);
+
+	switch (rec->op) {
+		case J_INSERT:
+			gb_insert_chunk(gb, rec->pos, payload, rec->len);
+			te->cursor_pos += rec->len;
+			break;
+		case J_DELETE:
+			if (rec->len > (uint32_t)gb->logical_size - rec->pos) return 0;
+			for (uint32_t i = rec->pos + rec->len; i > rec->pos; i--) gb_delete(gb, i);
+			break;
+		case J_SPLIT:
+			editor_split_line(te, line, rec->line, rec->pos);
+			break;
+		case J_JOIN:
+			if (!line->next) return 0;
+			te->cursor_pos = gb->logical_size;
+			editor_join_line(te, line, rec->line);
+			break;
+		case J_SET_LINE: {
+			char* buffer = malloc(rec->len + INIT_GAP_SIZE);
+			if (!buffer) {
+				perror("malloc");
+				exit(1);
+			}
+			memcpy(buffer, payload, rec->len);
+			gb_set_buffer(gb, buffer, rec->len, rec->len + INIT_GAP_SIZE);
+			break;
+		}
+		default:
+			return 0;
+	}
+	line->version++;
+	te->dirty = 1;
+	return 1;
+}
+
+// Replay the swap file a crashed session left behind and keep journaling into it.
+// Records are applied up to the first torn or damaged one, the rest is cut off.
+void editor_journal_recover(TextEditor* te){
+	char* path = journal_path(te->filename);
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0) close(fd);
+		free(path);
+		return;
+	}
+
+	// Another editor has the file open and is journaling into it
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		log_to_file("Swap file %s is in use, not journaling %s", path, te->filename);
+		te->journal_off = 1;
+		close(fd);
+		free(path);
+		return;
+	}
+
+	char* data = malloc(st.st_size + 1);
+	if (!data) {
+		perror("malloc");
+		exit(1);
+	}
+	long size = 0;
+	ssize_t n;
+	while (size < st.st_size && (n = read(fd, data + size, st.st_size - size)) > 0) size += n;
+
+	// Leave alone anything that is not one of ours
+	JournalHeader header;
+	if (size < (long)sizeof(JournalHeader) ||
+		(memcpy(&header, data, sizeof(JournalHeader)), header.magic != JOURNAL_MAGIC)) {
+		log_to_file("%s is not a swap file of this editor, not journaling %s", path, te->filename);
+		te->journal_off = 1;
+		free(data);
+		close(fd);
+		free(path);
+		return;
+	}
+
+	// Edits only make sense on top of the exact file they were made to
+	if (memcmp(&header, &te->journal_base, sizeof(JournalHeader)) != 0) {
+		char* old_path = malloc(strlen(path) + 5);
+		if (!old_path) {
+			perror("malloc");
+			exit(1);
+		}
+		sprintf(old_path, "%s.old", path);
+		rename(path, old_path);
+		log_to_file("Swap file %s does not match %s, kept as %s", path, te->filename, old_path);
+		free(old_path);
+		free(data);
+		close(fd);
+		free(path);
+		return;
+	}
+
+	te->journal_off = 1;
+	long offset = sizeof(JournalHeader);
+	int replayed = 0;
+	while (offset + (long)sizeof(JournalRecord) <= size) {
+		JournalRecord rec;
+		memcpy(&rec, data + offset, sizeof(rec));
+		long rec_size = sizeof(rec) + (journal_has_payload(rec.op) ? rec.len : 0);
+		if (rec_size > size - offset) break;
+		if (hash_bytes(data + offset + sizeof(uint32_t), rec_size - sizeof(uint32_t)) != rec.checksum) break;
+		if (!editor_journal_apply(te, &rec, data + offset + sizeof(rec))) break;
+		offset += rec_size;
+		replayed++;
+	}
+	te->journal_off = 0;
+	free(data);
+
+	if (replayed > 0) {
+		// Open where the last recovered edit was made
+		log_to_file("Recovered %d edits to %s from %s", replayed, te->filename, path);
+		if (te->cursor_pos > line_gb(te->cursor_line_ref)->logical_size) {
+			te->cursor_pos = line_gb(te->cursor_line_ref)->logical_size;
+		}
+		te->row_offset = te->cursor_line_num >= te->term_height ? te->cursor_line_num - te->term_height + 1 : 0;
+		editor_scroll_to_cursor(te);
+		te->full_redraw = 1;
+		editor_hl_reset(te);
+	}
+
+	if (ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+		close(fd);
+		free(path);
+		return;
+	}
+	te->journal = journal_start(fd, path);
+}
+
+int editor_open_file(TextEditor* te, const char* filename){
+	te->filename = strdup(filename);
+	if (!editor_load_file(te)) {
+		free(te->filename);
+		te->filename = NULL;
+		return 0;
+	}
+
+	editor_journal_recover(te);
+	editor_watch_file(te);
+	te->syntax = syntax_for_file(filename);
+	return 1;
+}
+
+// The file changed on disk, so the journal's edits no longer apply to it. Start a new
+// one against the new version that opens with a snapshot of the merged buffer
+void editor_journal_rebase(TextEditor* te){
+	journal_header_for(te->filename, &te->journal_base);
+	if (!te->journal) return;
+
+	journal_close(te->journal, 1);
+	te->journal = NULL;
+
+	long size = 0;
+	char* text = editor_pack_text(te, &size);
+	if (!text) return;
+
+	// Record lengths are 32 bits, a bigger snapshot cannot be written as one
+	if (size > INT_MAX) {
+		log_to_file("%s is too large to snapshot, not journaling it", te->filename);
+		te->journal_off = 1;
+		free(text);
+		return;
+	}
+	editor_journal(te, J_RESET, 0, 0, text, size);
+	free(text);
+}
+
+// Re-read the file and rebuild only the lines whose contents changed on disk.
+// Lines outside the changed region keep their nodes, so cursor and scroll state survive.
+int editor_reload_file(TextEditor* te){
+	// The disk hashes only line up with the buffer's lines while it is unmodified.
+	// Keep the local edits, and journal them against the new version of the file
+	if (te->dirty) {
+		log_to_file("%s changed on disk, keeping unsaved edits", te->filename);
+		editor_journal_rebase(te);
+		return 0;
+	}
+
+	long text_size = 0;
+	char* text = read_file_to_str(te->filename, &text_size);
+	if (!text) return 0;
+
+	int new_count = 0;
+	int* starts = split_lines(text, text_size, &new_count);
+	uint32_t* new_hashes = hash_lines(text, starts, new_count);
+
+	uint32_t* old_hashes = te->disk_line_hashes;
+	int old_count = te->disk_line_count;
+	int min_count = old_count < new_count ? old_count : new_count;
+
+	// Common prefix, whole blocks first
+	int prefix = 0;
+	while (prefix + RELOAD_BLOCK_LINES <= min_count &&
+		   memcmp(old_hashes + prefix, new_hashes + prefix, sizeof(uint32_t) * RELOAD_BLOCK_LINES) == 0) {
+		prefix += RELOAD_BLOCK_LINES;
+	}
+	while (prefix < min_count && old_hashes[prefix] == new_hashes[prefix]) prefix++;
+
+	// Common suffix, not overlapping the prefix
+	int suffix = 0;
+	int max_suffix = min_count - prefix;
+	while (suffix + RELOAD_BLOCK_LINES <= max_suffix &&
+		   memcmp(old_hashes + old_count - suffix - RELOAD_BLOCK_LINES,
+				  new_hashes + new_count - suffix - RELOAD_BLOCK_LINES,
+				  sizeof(uint32_t) * RELOAD_BLOCK_LINES) == 0) {
+		suffix += RELOAD_BLOCK_LINES;
+	}
+	while (suffix < max_suffix && old_hashes[old_count - suffix - 1] == new_hashes[new_count - suffix - 1]) suffix++;
+
+	int old_mid = old_count - prefix - suffix;
+	int new_mid = new_count - prefix - suffix;
+
+	if (old_mid != new_mid) {
+		// Extra cursors may point at lines about to be removed
+		te->structure_version++;
+		te->cursor_count = 0;
+	}
+
+	if (old_mid > 0 || new_mid > 0) {
+		te->full_redraw = 1;
+		LineNode* line = prefix > 0 ? editor_line_at(te, prefix - 1) : NULL;
+		LineNode* first = line ? line->next : te->head;
+		if (line) editor_hl_invalidate(te, line, prefix - 1);
+		else editor_hl_reset(te);
+		int cursor_line = te->cursor_line_num;
+
+		// Overwrite the nodes both versions share, skipping lines whose hash matches
+		LineNode* current = first;
+		int shared = old_mid < new_mid ? old_mid : new_mid;
+		for (int i = 0; i < shared; i++) {
+			int n = prefix + i;
+			if (old_hashes[n] != new_hashes[n] || old_mid != new_mid) {
+				editor_replace_line_text(current, text + starts[n], starts[n + 1] - starts[n] - 1);
+				bracket_index_touch(te, n);
+			}
+			line = current;
+			current = current->next;
+		}
+
+		// Insert lines the new version added
+		if (line && new_mid > shared) line_gb(line);
+		for (int i = shared; i < new_mid; i++) {
+			int n = prefix + i;
+			LineNode* new_line = line_create(text + starts[n], starts[n + 1] - starts[n] - 1);
+			new_line->prev = line;
+			new_line->next = current;
+			if (line) line->next = new_line;
+			else te->head = new_line;
+			if (current) current->prev = new_line;
+			line = new_line;
+			te->line_count++;
+		}
+
+		// Remove lines the new version dropped
+		for (int i = shared; i < old_mid; i++) {
+			line_gb(current);
+			LineNode* next = current->next;
+			if (line) line->next = next;
+			else te->head = next;
+			if (next) next->prev = line;
+
+			if (current == te->cursor_line_ref) te->cursor_line_ref = NULL;
+			line_free(current);
+			current = next;
+			te->line_count--;
+		}
+
+		// Keep the cursor on the same content when it sits below the changed region
+		if (cursor_line >= prefix + old_mid) {
+			te->cursor_line_num += new_mid - old_mid;
+		} else if (!te->cursor_line_ref) {
+			// Cursor line was deleted, move to the nearest surviving line
+			if (line) {
+				te->cursor_line_ref = line;
+				te->cursor_line_num = prefix + new_mid - 1;
+			} else {
+				te->cursor_line_ref = te->head;
+				te->cursor_line_num = 0;
+			}
+		}
+
+		if (te->cursor_pos > line_gb(te->cursor_line_ref)->logical_size) {
+			te->cursor_pos = line_gb(te->cursor_line_ref)->logical_size;
+		}
+		if (te->row_offset > te->cursor_line_num) te->row_offset = te->cursor_line_num;
+
+		// Lines that kept their nodes may have shrunk under the extra cursors
+		for (int i = 0; i < te->cursor_count; i++) {
+			Cursor* cur = &te->cursors[i];
+			int size = line_gb(cur->line)->logical_size;
+			if (cur->pos > size) cur->pos = size;
+		}
+	}
+
+	free(te->disk_line_hashes);
+	te->disk_line_hashes = new_hashes;
+	te->disk_line_count = new_count;
+	editor_note_disk_file(te, text_size);
+	free(starts);
+	free(text);
+	editor_journal_rebase(te);
+	return 1;
+}
+
+LineNode* editor_last_line(TextEditor* te){
+	if (!te->tail || te->tail_version != te->structure_version) {
+		te->tail = editor_line_at(te, te->line_count - 1);
+		te->tail_version = te->structure_version;
+	}
+	return te->tail;
+}
+
+// Put the cursor at the very end of the buffer and scroll it into view
+void editor_follow_pin(TextEditor* te){
+	te->cursor_line_ref = editor_last_line(te);
+	te->cursor_line_num = te->line_count - 1;
+	te->cursor_pos = line_gb(te->cursor_line_ref)->logical_size;
+	if (te->cursor_line_num >= te->row_offset + te->term_height) {
+		te->row_offset = te->cursor_line_num - te->term_height + 1;
+	}
+	editor_scroll_to_cursor(te);
+}
+
+// Add text read from the end of the file. It continues the last line and every newline
+// in it starts a new one; the lines before are not touched. The cursor and view follow
+// the end as long as the cursor is on the last line
+void editor_append_text(TextEditor* te, char* text, long size){
+	LineNode* last = editor_last_line(te);
+	int last_num = te->line_count - 1;
+	int pinned = te->cursor_line_ref == last;
+
+	char* nl = memchr(text, '\n', size);
+	long end = nl ? nl - text : size;
+	if (end > 0) {
+		int clean_size = 0;
+		char* clean = editor_sanitize_line(text, end, &clean_size);
+		GapBuffer* gb = line_gb(last);
+		gb_insert_chunk(gb, gb->logical_size, clean, clean_size);
+		free(clean);
+		last->version++;
+		editor_hl_invalidate(te, last, last_num);
+		editor_damage_line(te, last_num);
+	}
+
+	// Disk hashes: the last line's is extended, new lines get their own
+	long new_lines = 0;
+	for (char* p = nl; p; p = memchr(p + 1, '\n', text + size - p - 1)) new_lines++;
+	if (te->disk_line_hashes) {
+		int count = te->disk_line_count;
+		te->disk_line_hashes[count - 1] = hash_extend(te->disk_line_hashes[count - 1], text, end);
+		if (new_lines > 0) {
+			te->disk_line_hashes = realloc(te->disk_line_hashes, sizeof(uint32_t) * (count + new_lines));
+			if (!te->disk_line_hashes) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+	}
+
+	LineNode* line = last;
+	long start = end + 1;
+	for (long i = 0; i < new_lines; i++) {
+		nl = memchr(text + start, '\n', size - start);
+		end = nl ? nl - text : size;
+		LineNode* new_line = line_create(text + start, end - start);
+		new_line->prev = line;
+		line->next = new_line;
+		line = new_line;
+		te->line_count++;
+		editor_freeze_tail(te, new_line);
+		if (te->disk_line_hashes) te->disk_line_hashes[te->disk_line_count++] = hash_bytes(text + start, end - start);
+		start = end + 1;
+	}
+
+	if (new_lines > 0) {
+		te->structure_version++;
+		te->tail = line;
+		te->tail_version = te->structure_version;
+	}
+
+	if (pinned) editor_follow_pin(te);
+}
+
+// Read only what was appended to the file since the buffer last saw it. A file that
+// shrank or was replaced, as log rotation does, is reloaded in full instead
+int editor_follow_read(TextEditor* te){
+	int fd = open(te->filename, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0) close(fd);
+		return 0;
+	}
+	if (st.st_ino != te->disk_ino || st.st_size < te->disk_size) {
+		close(fd);
+		int pinned = te->cursor_line_ref == editor_last_line(te);
+		if (!editor_reload_file(te)) return 0;
+		if (pinned) editor_follow_pin(te);
+		return 1;
+	}
+
+	long size = st.st_size - te->disk_size;
+	if (size == 0) {
+		close(fd);
+		return 0;
+	}
+	char* text = malloc(size);
+	if (!text) {
+		perror("malloc");
+		exit(1);
+	}
+	long got = 0;
+	ssize_t n;
+	while (got < size && (n = pread(fd, text + got, size - got, te->disk_size + got)) > 0) got += n;
+	close(fd);
+
+	if (got > 0) editor_append_text(te, text, got);
+	te->disk_size += got;
+	free(text);
+
+	// Journaled edits still apply to the grown file
+	if (got == size) {
+		journal_header_from(&st, &te->journal_base);
+		if (te->journal && !journal_set_base(te->journal, &te->journal_base)) {
+			// The swap file still names the old size, start over from a snapshot
+			log_to_file("Cannot update swap file for %s", te->filename);
+			editor_journal_rebase(te);
+		}
+	}
+	return got > 0;
+}
+
+// Follow mode on or off. Turning it on catches up with the file and moves to its end
+void editor_toggle_follow(TextEditor* te){
+	if (!te->filename) return;
+	te->follow = !te->follow;
+	editor_watch_file(te);
+	if (!te->follow || te->state != BUF_LOADED) return;
+
+	editor_follow_read(te);
+	editor_follow_pin(te);
+	te->full_redraw = 1;
+}
+
+// Drain pending inotify events, reloading if the watched file was rewritten
+int editor_check_file_changes(TextEditor* te){
+	if (te->watch_fd < 0) return 0;
+
+	const char* name = strrchr(te->filename, '/');
+	name = name ? name + 1 : te->filename;
+
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed = 0;
+	int appended = 0;
+	ssize_t len;
+	while ((len = read(te->watch_fd, events, sizeof(events))) > 0) {
+		for (char* p = events; p < events + len; ) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			if (ev->len > 0 && strcmp(ev->name, name) == 0) {
+				if (ev->mask & IN_MODIFY) appended = 1;
+				else changed = 1;
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	if (!changed && !appended) return 0;
+
+	// Compacted buffers pick the change up when they are restored
+	if (te->state != BUF_LOADED) {
+		te->reload_pending = 1;
+		return 0;
+	}
+	if (te->follow) return editor_follow_read(te);
+	return editor_reload_file(te);
+}
+
+
+// Buffers inactive for this long are compacted even when under budget
+#define BUFFER_IDLE_SECS 120
+#define BUFFER_MEM_BUDGET (512L * 1024 * 1024)
+
+size_t buffer_mem_budget = BUFFER_MEM_BUDGET; // Set with --budget
+
+size_t editor_memory_usage(TextEditor* te){
+	if (te->state == BUF_PACKED) return te->packed_size;
+	if (te->state == BUF_ON_DISK) return sizeof(uint32_t) * te->disk_line_count;
+
+	size_t total = 0;
+	for (LineNode* line = te->head; line != NULL; line = line->next) {
+		if (line->text) {
+			// Interned text is split between the lines sharing it
+			GapBuffer* gb = line->text;
+			total += sizeof(LineNode) + sizeof(GapBuffer) + (gb->shared ? gb->cap / gb->shared->refs : gb->cap);
+		} else {
+			total += sizeof(LineNode);
+			if (line == line->cold->first) total += sizeof(ColdBlock) + line->cold->comp_size;
+		}
+	}
+	return total;
+}
+
+// Drop the per-line allocations of an inactive buffer. Unmodified files go back to
+// their on-disk form, modified ones are packed into a single gapless block.
+void editor_compact(TextEditor* te){
+	if (te->state != BUF_LOADED) return;
+
+	// The line hashes stay, so restoring an unchanged file skips rehashing it
+	if (!te->dirty && te->filename) {
+		editor_free_lines(te);
+		te->state = BUF_ON_DISK;
+		te->mem_bytes = editor_memory_usage(te);
+		return;
+	}
+
+	long packed_size = 0;
+	char* packed = editor_pack_text(te, &packed_size);
+	if (!packed) return;
+
+	editor_free_lines(te);
+	te->packed = packed;
+	te->packed_size = packed_size;
+	te->state = BUF_PACKED;
+	te->mem_bytes = packed_size;
+}
+
+// Rebuild the line list of a compacted buffer and put the cursor back where it was
+int editor_restore(TextEditor* te){
+	if (te->state == BUF_LOADED) return 1;
+
+	int cursor_line = te->cursor_line_num;
+
+	if (te->state == BUF_ON_DISK) {
+		if (!editor_load_file(te)) return 0;
+		te->reload_pending = 0;
+	} else {
+		// Packed lines are already sanitized, so they go straight into gap buffers
+		LineNode* prev = NULL;
+		long line_start = 0;
+		while (line_start < te->packed_size) {
+			char* nl = memchr(te->packed + line_start, '\n', te->packed_size - line_start);
+			long line_end = nl - te->packed;
+
+			GapBuffer* gb = malloc(sizeof(GapBuffer));
+			gb_init(gb, te->packed + line_start, line_end - line_start);
+			LineNode* line = line_alloc(gb);
+			line->prev = prev;
+			if (prev) prev->next = line;
+			else te->head = line;
+
+			prev = line;
+			te->line_count++;
+			editor_freeze_tail(te, line);
+			line_start = line_end + 1;
+		}
+
+		free(te->packed);
+		te->packed = NULL;
+		te->packed_size = 0;
+		te->structure_version++;
+	}
+	te->state = BUF_LOADED;
+
+	if (cursor_line >= te->line_count) cursor_line = te->line_count - 1;
+	te->cursor_line_num = cursor_line;
+	te->cursor_line_ref = editor_line_at(te, cursor_line);
+	if (te->cursor_pos > line_gb(te->cursor_line_ref)->logical_size) {
+		te->cursor_pos = line_gb(te->cursor_line_ref)->logical_size;
+	}
+	if (te->row_offset > te->cursor_line_num) te->row_offset = te->cursor_line_num;
+
+	if (te->reload_pending) {
+		te->reload_pending = 0;
+		editor_reload_file(te);
+	}
+	return 1;
+}
+
+
+typedef struct {
+	TextEditor** buffers;
+	int count;
+	int cap;
+	int active;
+	size_t mem_budget;
+} BufferList;
+
+void bl_init(BufferList* bl){
+	bl->buffers = NULL;
+	bl->count = 0;
+	bl->cap = 0;
+	bl->active = 0;
+	bl->mem_budget = buffer_mem_budget;
+}
+
+void bl_free(BufferList* bl){
+	for (int i = 0; i < bl->count; i++) {
+		editor_free(bl->buffers[i]);
+		free(bl->buffers[i]);
+	}
+	free(bl->buffers);
+	bl->buffers = NULL;
+	bl->count = 0;
+}
+
+// Returns the index of the buffer holding filename, opening it if needed
+int bl_open(BufferList* bl, const char* filename){
+	for (int i = 0; i < bl->count; i++) {
+		if (bl->buffers[i]->filename && strcmp(bl->buffers[i]->filename, filename) == 0) return i;
+	}
+
+	TextEditor* te = malloc(sizeof(TextEditor));
+	editor_init(te);
+	if (!editor_open_file(te, filename)) {
+		free(te);
+		return -1;
+	}
+	if (!te->cursor_line_ref) editor_set_cursor_to_first_line(te);
+	te->mem_bytes = editor_memory_usage(te);
+
+	if (bl->count == bl->cap) {
+		bl->cap = bl->cap ? bl->cap * 2 : 4;
+		bl->buffers = realloc(bl->buffers, sizeof(TextEditor*) * bl->cap);
+	}
+	bl->buffers[bl->count] = te;
+	return bl->count++;
+}
+
+TextEditor* bl_active(BufferList* bl){
+	return bl->buffers[bl->active];
+}
+
+// Compact least recently used inactive buffers until the total fits the budget
+void bl_enforce_budget(BufferList* bl){
+	size_t total = 0;
+	for (int i = 0; i < bl->count; i++) total += bl->buffers[i]->mem_bytes;
+
+	while (total > bl->mem_budget) {
+		TextEditor* lru = NULL;
+		for (int i = 0; i < bl->count; i++) {
+			TextEditor* te = bl->buffers[i];
+			if (i == bl->active || te->attached || te->state != BUF_LOADED) continue;
+			if (!lru || te->last_active < lru->last_active) lru = te;
+		}
+		if (!lru) break;
+
+		total -= lru->mem_bytes;
+		editor_compact(lru);
+		total += lru->mem_bytes;
+	}
+}
+
+void bl_compact_idle(BufferList* bl){
+	time_t now = time(NULL);
+	for (int i = 0; i < bl->count; i++) {
+		TextEditor* te = bl->buffers[i];
+		if (i == bl->active || te->attached || te->state != BUF_LOADED) continue;
+		if (now - te->last_active >= BUFFER_IDLE_SECS) editor_compact(te);
+	}
+}
+
+int bl_switch(BufferList* bl, int index){
+	if (index < 0 || index >= bl->count || index == bl->active) return 0;
+
+	TextEditor* old = bl_active(bl);
+	old->last_active = time(NULL);
+	old->mem_bytes = editor_memory_usage(old);
+
+	TextEditor* te = bl->buffers[index];
+	if (!editor_restore(te)) return 0;
+	te->full_redraw = 1;
+	te->last_active = time(NULL);
+	te->mem_bytes = editor_memory_usage(te);
+	bl->active = index;
+
+	bl_enforce_budget(bl);
+	return 1;
+}
+
+
+// Event loop. A single epoll set multiplexes the terminal, file watches, signals
+// (through signalfd), timers (through timerfd) and completions posted by worker
+// threads (through eventfd). Handlers run on the loop thread one at a time.
+
+struct EventLoop;
+typedef void (*EventHandler)(struct EventLoop* loop, int fd, void* data);
+
+typedef struct {
+	int fd;
+	EventHandler handler;
+	void* data;
+	int owned; // fd is closed when the source goes away
+} EventSource;
+
+typedef struct EventLoop {
+	int epoll_fd;
+	EventSource* sources;
+	int count;
+	int cap;
+	int running;
+} EventLoop;
+
+void ev_init(EventLoop* loop){
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	loop->sources = NULL;
+	loop->count = 0;
+	loop->cap = 0;
+	loop->running = 0;
+}
+
+void ev_free(EventLoop* loop){
+	for (int i = 0; i < loop->count; i++) {
+		if (loop->sources[i].owned) close(loop->sources[i].fd);
+	}
+	free(loop->sources);
+	close(loop->epoll_fd);
+	loop->sources = NULL;
+	loop->count = 0;
+}
+
+EventSource* ev_find(EventLoop* loop, int fd){
+	for (int i = 0; i < loop->count; i++) {
+		if (loop->sources[i].fd == fd) return &loop->sources[i];
+	}
+	return NULL;
+}
+
+// events as for epoll_ctl; the handler is not told which of them fired
+int ev_add_events(EventLoop* loop, int fd, uint32_t events, EventHandler handler, void* data, int owned){
+	if (fd < 0) return 0;
+
+	struct epoll_event event = {0};
+	event.events = events;
+	event.data.fd = fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) return 0;
+
+	if (loop->count == loop->cap) {
+		loop->cap = loop->cap ? loop->cap * 2 : 8;
+		loop->sources = realloc(loop->sources, sizeof(EventSource) * loop->cap);
+		if (!loop->sources) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	loop->sources[loop->count++] = (EventSource){fd, handler, data, owned};
+	return 1;
+}
+
+int ev_add(EventLoop* loop, int fd, EventHandler handler, void* data, int owned){
+	return ev_add_events(loop, fd, EPOLLIN, handler, data, owned);
+}
+
+void ev_remove(EventLoop* loop, int fd){
+	EventSource* source = ev_find(loop, fd);
+	if (!source) return;
+
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	if (source->owned) close(fd);
+	*source = loop->sources[--loop->count];
+}
+
+// Arms a timer to fire after delay_ms (as soon as possible when <= 0), then every
+// interval_ms if that is positive
+void ev_timer_set(int fd, long delay_ms, long interval_ms){
+	struct itimerspec spec = {0};
+	if (delay_ms > 0) {
+		spec.it_value.tv_sec = delay_ms / 1000;
+		spec.it_value.tv_nsec = (delay_ms % 1000) * 1000000;
+	} else {
+		spec.it_value.tv_nsec = 1; // Zero would disarm the timer
+	}
+	spec.it_interval.tv_sec = interval_ms / 1000;
+	spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	timerfd_settime(fd, 0, &spec, NULL);
+}
+
+// Returns the timer fd, -1 on failure. A negative delay leaves it disarmed
+int ev_add_timer(EventLoop* loop, long delay_ms, long interval_ms, EventHandler handler, void* data){
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) return -1;
+	if (!ev_add(loop, fd, handler, data, 1)) {
+		close(fd);
+		return -1;
+	}
+	if (delay_ms >= 0) ev_timer_set(fd, delay_ms, interval_ms);
+	return fd;
+}
+
+// Delivers signo through the loop instead of as an asynchronous signal.
+// Must run before any thread is started so they inherit the blocked mask
+int ev_add_signal(EventLoop* loop, int signo, EventHandler handler, void* data){
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, signo);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) return -1;
+
+	int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) return -1;
+	if (!ev_add(loop, fd, handler, data, 1)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// An fd worker threads can poke with ev_wakeup() to get handler run on the loop
+int ev_add_wakeup(EventLoop* loop, EventHandler handler, void* data){
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) return -1;
+	if (!ev_add(loop, fd, handler, data, 1)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void ev_wakeup(int fd){
+	uint64_t one = 1;
+	write(fd, &one, sizeof(one));
+}
+
+// Drains a timerfd, eventfd or signalfd so it stops reporting readable
+void ev_drain(int fd){
+	char buf[sizeof(struct signalfd_siginfo)];
+	while (read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+void ev_run(EventLoop* loop){
+	struct epoll_event events[16];
+	loop->running = 1;
+	while (loop->running) {
+		int n = epoll_wait(loop->epoll_fd, events, 16, -1);
+		if (n < 0) continue; // EINTR
+
+		for (int i = 0; i < n && loop->running; i++) {
+			// Look the source up each time, an earlier handler may have removed it
+			EventSource* source = ev_find(loop, events[i].data.fd);
+			if (source) source->handler(loop, source->fd, source->data);
+		}
+	}
+}
+
+
+#define KEY_CTRL(k) ((k) & 0x1f)
+#define REPEAT_MAX 1000000000L
+#define INPUT_BUF_SZ 4096
+#define DEFAULT_FPS 60
+
+typedef struct {
+	char buffer[INPUT_BUF_SZ];
+	int start;
+	int end;
+} InputQueue;
+
+void input_init(InputQueue* q){
+	q->start = 0;
+	q->end = 0;
+}
+
+// Move unread keys to the front to make room at the end
+void input_compact(InputQueue* q){
+	if (q->start > 0) {
+		memmove(q->buffer, q->buffer + q->start, q->end - q->start);
+		q->end -= q->start;
+		q->start = 0;
+	}
+}
+
+// Reads everything pending on stdin without blocking (the terminal is in
+// VMIN=0 mode). Returns the number of bytes read
+int input_fill(InputQueue* q){
+	input_compact(q);
+
+	int total = 0;
+	while (q->end < INPUT_BUF_SZ) {
+		ssize_t n = read(STDIN_FILENO, q->buffer + q->end, INPUT_BUF_SZ - q->end);
+		if (n <= 0) break;
+		q->end += n;
+		total += n;
+	}
+	return total;
+}
+
+// Pops one keypress: a single byte or a 3 byte escape sequence.
+// Returns its length, 0 if no complete key is buffered yet
+int input_next_key(InputQueue* q, char* key){
+	int avail = q->end - q->start;
+	if (avail == 0) return 0;
+
+	int len = q->buffer[q->start] == '\033' ? 3 : 1;
+	if (avail < len) return 0;
+	memcpy(key, q->buffer + q->start, len);
+	q->start += len;
+	return len;
+}
+
+long monotonic_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Keys typed while the replace prompt is open. Enter takes the text to find, then
+// its replacement and replaces every occurrence. Ctrl-G cancels
+void editor_prompt_key(TextEditor* te, const char* key, int len, int headless){
+	unsigned char c = key[0];
+	if (len != 1) return;
+
+	if (c == KEY_CTRL('g')) {
+		te->prompt = PROMPT_NONE;
+		te->full_redraw = 1;
+	} else if (c == 127) {
+		while (te->prompt_len > 0 && utf8_is_continuation(te->prompt_text[--te->prompt_len]));
+	} else if (c == 13 && te->prompt == PROMPT_FIND) {
+		memcpy(te->find_text, te->prompt_text, te->prompt_len);
+		te->find_len = te->prompt_len;
+		te->prompt = PROMPT_REPLACE;
+		te->prompt_len = 0;
+	} else if (c == 13) {
+		te->prompt = PROMPT_NONE;
+		te->full_redraw = 1;
+		long count = editor_replace_all(te, te->find_text, te->find_len, te->prompt_text, te->prompt_len);
+		if (!headless) log_to_file("Replaced %ld occurrences", count);
+	} else if (c >= 32 && te->prompt_len < PROMPT_MAX) {
+		te->prompt_text[te->prompt_len++] = c;
+	}
+}
+
+// Applies one keypress to the active buffer. Headless skips terminal output
+// and logging so macros can be replayed straight against the edit engine
+void editor_process_key(BufferList* bl, const char* key, int len, int headless){
+	TextEditor* te = bl_active(bl);
+	char c = key[0];
+
+	if (te->prompt != PROMPT_NONE) {
+		editor_prompt_key(te, key, len, headless);
+		return;
+	}
+
+	if (c == '\033') { // Escape sequence
+		const char* seq = key + 1;
+		if (len == 3 && seq[0] == '[') {
+			if (te->cursor_count > 0) editor_multi_move(te, seq[1]);
+			switch (seq[1]) {
+				case 'A': // Up arrow
+					editor_cursor_up(te);
+					break;
+				case 'B': // Down arrow
+					editor_cursor_down(te);
+					break;
+				case 'D': // Left arrow
+                        if (te->cursor_pos > 0) {
+                            te->cursor_pos = line_prev_char(te->cursor_line_ref, te->cursor_pos);
+                            editor_scroll_to_cursor(te);
+                        }
+
+					break;
+				case 'C': // Right arrow
+                        if (te->cursor_pos < line_gb(te->cursor_line_ref)->logical_size) {
+                            te->cursor_pos = line_next_char(te->cursor_line_ref, te->cursor_pos);
+                            editor_scroll_to_cursor(te);
+                        }
+					break;
+				default:
+					if (!headless) log_to_file("Unknown escape sequence: \\033[%c", seq[1]);
+					break;
+			}
+		}
+	} else if (iscntrl(c)) {
+		if (c == 127 && te->cursor_count > 0) { // Backspace at every cursor
+			editor_multi_backspace(te);
+		} else if (c == 127) { // Backspace
+                if (te->cursor_pos > 0) {
+				// Remove every byte of the character before the cursor
+				int char_start = line_prev_char(te->cursor_line_ref, te->cursor_pos);
+				while (te->cursor_pos > char_start) {
+					editor_remove_char(te);
+					te->cursor_pos--;
+				}
+				editor_scroll_to_cursor(te);
+                } else if (te->cursor_line_ref->prev) {
+				// Append anything before cursor on the line to prev line
+				LineNode* prev_line = te->cursor_line_ref->prev;
+				int prev_size = line_gb(prev_line)->logical_size;
+				editor_join_line(te, prev_line, te->cursor_line_num - 1);
+
+				te->cursor_line_ref = prev_line;
+				te->cursor_line_num--;
+				te->cursor_pos = prev_size;
+
+				// Horizontal Scrolling, if prev line needs scrolling when moving to it
+				editor_scroll_to_cursor(te);
+
+
+			   // Adjust scrolling
+				if (te->cursor_line_num < te->row_offset) {
+					te->row_offset--;
+				}
+			}
+		}
+
+		if(c == 13){ // Enter
+			if (te->cursor_count > 0) editor_multi_newline(te);
+			else editor_insert_newline(te);
+		}
+
+		if(c == KEY_CTRL('d')){ // Add a cursor on the next line
+			editor_add_cursor_below(te);
+		}
+
+		if(c == KEY_CTRL('g')){ // Back to a single cursor
+			editor_clear_cursors(te);
+		}
+
+		if(c == KEY_CTRL('f')){ // Replace all
+			te->prompt = PROMPT_FIND;
+			te->prompt_len = 0;
+		}
+
+		if(c == KEY_CTRL('z')){ // Undo the last replace all
+			editor_undo(te);
+			editor_scroll_to_cursor(te);
+		}
+
+		if(c == KEY_CTRL('b')){ // Jump to the matching bracket
+			editor_jump_to_bracket(te);
+		}
+
+		if(c == KEY_CTRL('t')){ // Toggle tail-follow
+			editor_toggle_follow(te);
+		}
+
+		if(c == KEY_CTRL('w')){ // Toggle soft wrap
+			editor_toggle_soft_wrap(te);
+		}
+
+		if(c == KEY_CTRL('n') || c == KEY_CTRL('p')){ // Next / previous buffer
+			int step = c == KEY_CTRL('n') ? 1 : bl->count - 1;
+			if (bl_switch(bl, (bl->active + step) % bl->count)) {
+				te = bl_active(bl);
+				if (!headless) editor_write(te, CLEAR_HOME, strlen(CLEAR_HOME));
+			}
+		}
+
+		if(c == 9){ // Tab
+			
+			int spaces_to_insert = TAB_WIDTH - (line_col_of(te->cursor_line_ref, te->cursor_pos) % TAB_WIDTH);
+			if (te->cursor_count > 0) {
+				editor_multi_insert(te, "        ", 0, 1);
+				spaces_to_insert = 0;
+			}
+			for (int i = 0; i < spaces_to_insert; i++) {
+				editor_insert_char(te, ' ');
+				te->cursor_pos++;
+			}
+			editor_scroll_to_cursor(te);
+
+		}
+		if (!headless) log_to_file("%d (control)", c);
+
+	} else {
+		if (!headless) log_to_file("Char inserted: %d ('%c')", c, c);
+		if (te->cursor_count > 0) {
+			editor_multi_insert(te, &c, 1, 0);
+		} else {
+			editor_insert_char(te, c);
+			te->cursor_pos++;
+
+			// Handle horrizontal scrolling
+			editor_scroll_to_cursor(te);
+		}
+	}
+
+}
+
+
+typedef struct {
+	char* keys;
+	int size;
+	int cap;
+	int recording;
+	long repeat; // Ctrl-U count for the next replay
+	int counting;
+} KeyMacro;
+
+void macro_init(KeyMacro* m){
+	m->keys = NULL;
+	m->size = 0;
+	m->cap = 0;
+	m->recording = 0;
+	m->repeat = 0;
+	m->counting = 0;
+}
+
+void macro_free(KeyMacro* m){
+	free(m->keys);
+	macro_init(m);
+}
+
+void macro_start(KeyMacro* m){
+	m->size = 0;
+	m->recording = 1;
+}
+
+void macro_record(KeyMacro* m, const char* key, int len){
+	if (m->size + len > m->cap) {
+		m->cap = m->cap ? m->cap * 2 : 64;
+		m->keys = realloc(m->keys, m->cap);
+		if (!m->keys) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(m->keys + m->size, key, len);
+	m->size += len;
 }
 
-void editor_set_text(TextEditor* te, char* text, int text_size) {
-    int line_start = 0;
-    int current_pos = 0;
-    LineNode* current_line = NULL;
-
-    while (current_pos <= text_size) {
-
-        // Treat end of text as a newline
-        if (current_pos == text_size || text[current_pos] == '\n') {
-
-			// Create new line
-            LineNode* new_line = malloc(sizeof(LineNode));
-            GapBuffer* gb = malloc(sizeof(GapBuffer));
-
-			int new_line_size = 0;
-			char* new_line_text = editor_sanitize_line(text + line_start, current_pos - line_start, &new_line_size);
-            gb_init(gb, new_line_text, new_line_size);
-			free(new_line_text);
-            new_line->text = gb;
-
-            // Add new line node to linked list
-            if (current_line == NULL) {
-                // First line
-                new_line->prev = NULL;
-                new_line->next = NULL;
-                te->head = new_line;
-            } else {
-                // Link to previous line
-                new_line->next = NULL;
-                new_line->prev = current_line;
-                current_line->next = new_line;
-            }
-
-            current_line = new_line;
-            te->line_count++;
-
-            // Move to the next line
-            current_pos++; // Skip newline or move past the end of text
-            line_start = current_pos;
-        } else {
-            current_pos++;
-        }
-    }
+// Runs the macro times over without rendering; the caller redraws once after
+void macro_replay(BufferList* bl, KeyMacro* m, long times){
+	if (m->size == 0) return;
+
+	for (long n = 0; n < times; n++) {
+		for (int i = 0; i < m->size;) {
+			int len = m->keys[i] == '\033' ? 3 : 1;
+			editor_process_key(bl, m->keys + i, len, 1);
+			i += len;
+		}
+	}
+
+	bl_active(bl)->full_redraw = 1;
 }
 
+// Handles one keypress from the terminal, including the macro keys.
+// Returns 0 when the editor should quit
+int editor_handle_key(BufferList* bl, KeyMacro* m, const char* key, int len){
+	if (len == 1 && key[0] == 'q' && bl_active(bl)->prompt == PROMPT_NONE) return 0;
 
-void editor_set_cursor_to_first_line(TextEditor* te) {
-    if (te->head) {
-        te->cursor_line_ref = te->head;
-        te->cursor_line_num = 0; 
-        te->cursor_pos = 0;
-    }
+	if (m->counting && len == 1 && isdigit((unsigned char)key[0])) {
+		if (m->repeat < REPEAT_MAX / 10) m->repeat = m->repeat * 10 + (key[0] - '0');
+		return 1;
+	}
+	long times = m->repeat > 0 ? m->repeat : 1;
+	m->counting = 0;
+	m->repeat = 0;
+
+	if (len == 1 && key[0] == KEY_CTRL('u')) { // Count prefix for replay
+		m->counting = 1;
+		return 1;
+	}
+	if (len == 1 && key[0] == KEY_CTRL('r')) { // Start / stop recording
+		if (m->recording) m->recording = 0;
+		else macro_start(m);
+		log_to_file("Macro recording %s (%d bytes)", m->recording ? "started" : "stopped", m->size);
+		return 1;
+	}
+	if (len == 1 && key[0] == KEY_CTRL('e')) { // Replay last macro
+		if (!m->recording) macro_replay(bl, m, times);
+		return 1;
+	}
+
+	if (m->recording) macro_record(m, key, len);
+	editor_process_key(bl, key, len, 0);
+	return 1;
 }
 
+// Background highlighting. The main thread copies a chunk of lines (with the lexer
+// state at its first line) into a job, so the worker never touches the live line
+// store; the worker lexes it and posts the start state of every line back through
+// the event loop. Results are applied only if nothing was edited in the meantime,
+// otherwise the pass just resumes from the new frontier.
+
+#define HL_CHUNK_LINES 4096
+
+typedef struct HighlightJob {
+	TextEditor* te;             // Only compared against, never read by the worker
+	unsigned int structure_version;
+	unsigned int edit_serial;
+	LineNode* first;
+	int first_line;
+	int count;
+	char* text;                 // The lines' text back to back
+	int* starts;                // count + 1 offsets into text
+	int text_cap;
+	unsigned char* states;      // Start state of each line, then the end state of the last
+	struct HighlightJob* next;
+} HighlightJob;
 
-void editor_insert_char(TextEditor* te, char c){
-	gb_insert(te->cursor_line_ref->text, te->cursor_pos, c);
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	HighlightJob* pending;
+	HighlightJob* done;
+	int wakeup_fd;              // Loop eventfd poked when a job finishes
+	int stop;
+} HighlightWorker;
+
+void hl_job_free(HighlightJob* job){
+	free(job->text);
+	free(job->starts);
+	free(job->states);
+	free(job);
 }
 
-void editor_remove_char(TextEditor* te){
-	gb_delete(te->cursor_line_ref->text, te->cursor_pos);
+// Adds a line of size bytes to the job and returns where its text goes
+char* hl_job_add_line(HighlightJob* job, int size){
+	int used = job->starts[job->count];
+	if (used + size >= job->text_cap) {
+		job->text_cap = (used + size + 1) * 2;
+		job->text = realloc(job->text, job->text_cap);
+		if (!job->text) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	job->starts[++job->count] = used + size;
+	return job->text + used;
 }
 
-void editor_insert_newline(TextEditor* te){
-	// Create new line
-	LineNode* new_line = malloc(sizeof(LineNode));
-	GapBuffer* gb = malloc(sizeof(GapBuffer));
-	
-    // Split index
-    int split_index = te->cursor_pos;
+// Snapshot up to HL_CHUNK_LINES lines from the analysis frontier. Cold lines are read
+// by decoding their block into the job, so the pass does not thaw the whole file
+HighlightJob* editor_hl_make_job(TextEditor* te){
+	HighlightJob* job = malloc(sizeof(HighlightJob));
+	if (!job) {
+		perror("malloc");
+		exit(1);
+	}
+	job->te = te;
+	job->structure_version = te->structure_version;
+	job->edit_serial = te->hl_edit_serial;
+	job->first_line = te->hl_frontier;
+	job->first = te->hl_resume_line ? te->hl_resume_line : editor_line_at(te, te->hl_frontier);
+	job->count = 0;
+	job->text = NULL;
+	job->text_cap = 0;
+	// A cold block may run past the chunk size, leave room for one
+	job->starts = malloc(sizeof(int) * (HL_CHUNK_LINES + COLD_BLOCK_LINES + 1));
+	job->states = malloc(HL_CHUNK_LINES + COLD_BLOCK_LINES + 1);
+	if (!job->starts || !job->states) {
+		perror("malloc");
+		exit(1);
+	}
+	job->starts[0] = 0;
+	job->states[0] = te->hl_resume_state;
+	job->next = NULL;
+
+	LineNode* line = job->first;
+	while (line && job->count < HL_CHUNK_LINES) {
+		if (line->text) {
+			// Giant lines are not highlighted, and pass their start state on unchanged
+			GapBuffer* gb = line->text;
+			int size = gb->logical_size < LONG_LINE_BYTES ? gb->logical_size : 0;
+			gb_copy_range(gb, 0, size, hl_job_add_line(job, size));
+			line = line->next;
+			continue;
+		}
 
-    // Move the gap in the current line to the split index
-    gb_move_gap(te->cursor_line_ref->text, split_index);
+		// Decode the block once and take every remaining line of it
+		ColdBlock* block = line->cold;
+		char* raw = malloc(block->raw_size + 1);
+		if (!raw) {
+			perror("malloc");
+			exit(1);
+		}
+		cold_block_decode(block, raw);
 
-    // Initialize new line's gap buffer with text after the split
-    char* after_split_text = te->cursor_line_ref->text->buffer + te->cursor_line_ref->text->gap_end;
-    int after_split_size = te->cursor_line_ref->text->cap - te->cursor_line_ref->text->gap_end;
-    gb_init(gb, after_split_text, after_split_size);
-    new_line->text = gb;
+		int offset = 0;
+		for (LineNode* l = block->first; l != line; l = l->next) {
+			offset = (char*)memchr(raw + offset, '\n', block->raw_size - offset) - raw + 1;
+		}
+		while (line && !line->text && line->cold == block) {
+			char* nl = memchr(raw + offset, '\n', block->raw_size - offset);
+			int end = nl ? nl - raw : block->raw_size;
+			memcpy(hl_job_add_line(job, end - offset), raw + offset, end - offset);
+			offset = end + 1;
+			line = line->next;
+		}
+		free(raw);
+	}
+	return job;
+}
 
-    // Truncate the current line's logical size to the split index
-    te->cursor_line_ref->text->logical_size = split_index;
-    te->cursor_line_ref->text->gap_end = te->cursor_line_ref->text->cap;
+// Only the state at the end of each line is kept, the visible lines are lexed when drawn
+void hl_job_run(HighlightJob* job){
+	for (int i = 0; i < job->count; i++) {
+		int start = job->starts[i];
+		job->states[i + 1] = highlight_line_state(job->text + start, job->starts[i + 1] - start, job->states[i]);
+	}
+}
 
-    // Update the linked list
-    if (te->cursor_line_ref->next) {
-        te->cursor_line_ref->next->prev = new_line;
-        new_line->next = te->cursor_line_ref->next;
-    } else {
-        new_line->next = NULL;
-    }
-    new_line->prev = te->cursor_line_ref;
-    te->cursor_line_ref->next = new_line;
+void* hl_worker_main(void* arg){
+	HighlightWorker* w = arg;
 
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		if (!w->pending) {
+			pthread_cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+		HighlightJob* job = w->pending;
+		w->pending = job->next;
+		pthread_mutex_unlock(&w->lock);
 
-	// Update Editor fields
-	te->cursor_line_ref = new_line;
-	te->cursor_line_num++;
-	te->line_count++;
-    te->cursor_pos = 0;
+		hl_job_run(job);
 
-	// No offset 
-	te->col_offset = 0;
+		pthread_mutex_lock(&w->lock);
+		job->next = w->done;
+		w->done = job;
+		ev_wakeup(w->wakeup_fd);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
 
+int hl_worker_start(HighlightWorker* w, int wakeup_fd){
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->pending = NULL;
+	w->done = NULL;
+	w->wakeup_fd = wakeup_fd;
+	w->stop = 0;
+	return pthread_create(&w->thread, NULL, hl_worker_main, w) == 0;
+}
 
+void hl_worker_stop(HighlightWorker* w){
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	HighlightJob* lists[2] = {w->pending, w->done};
+	for (int i = 0; i < 2; i++) {
+		while (lists[i]) {
+			HighlightJob* next = lists[i]->next;
+			lists[i]->te->hl_job_pending = 0;
+			hl_job_free(lists[i]);
+			lists[i] = next;
+		}
+	}
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
 }
 
-void handle_cursor_line_move(TextEditor* te, LineNode* current, LineNode* goal){
-	int current_len = current->text->logical_size;
-	int goal_len= goal->text->logical_size;
+// Hand the next chunk of the analysis pass to the worker, one job per buffer at a time
+void editor_hl_schedule(TextEditor* te, HighlightWorker* w){
+	if (!te->syntax || te->hl_job_pending || te->state != BUF_LOADED) return;
+	if (te->hl_frontier >= te->line_count) return;
 
-    if (te->cursor_pos > goal_len) {
-        te->cursor_pos = goal_len;
-    }
+	HighlightJob* job = editor_hl_make_job(te);
+	te->hl_job_pending = 1;
 
-	// If when moving the cursor ot new line, the text is not visible due to the col_offset
-    // Adjust col_offset to ensure the cursor is visible
-    if (te->cursor_pos < te->col_offset) {
-        te->col_offset = te->cursor_pos; // Scroll left
-    } else if (te->cursor_pos >= te->col_offset + (te->term_width - te->line_number_width)) {
-        te->col_offset = te->cursor_pos - (te->term_width - te->line_number_width) + 1; // Scroll right
-    }
+	pthread_mutex_lock(&w->lock);
+	job->next = w->pending;
+	w->pending = job;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
 }
 
-void editor_cursor_up(TextEditor* te){
-	// Bounds Check
-	if(te->cursor_line_num <= 0) return;
+// Store a finished job's states. Returns 1 when a visible line changed colour
+int editor_hl_apply(TextEditor* te, HighlightJob* job){
+	te->hl_job_pending = 0;
+	if (job->structure_version != te->structure_version || job->edit_serial != te->hl_edit_serial) return 0;
+
+	int visible = 0;
+	int row_end = te->row_offset + te->term_height;
+	LineNode* line = job->first;
+	for (int i = 0; i < job->count; i++, line = line->next) {
+		if (line->hl_known && line->hl_state_in == job->states[i]) continue;
+		int n = job->first_line + i;
+
+		// Brackets were counted as if an unknown line started outside a comment
+		int counted = line->hl_known ? line->hl_state_in : HL_STATE_NORMAL;
+		if (counted != job->states[i]) bracket_index_touch(te, n);
+		line->hl_state_in = job->states[i];
+		line->hl_known = 1;
+		if (n >= te->row_offset && n < row_end) visible = 1;
+	}
 
-	handle_cursor_line_move(te, te->cursor_line_ref, te->cursor_line_ref->prev );
-	te->cursor_line_ref = te->cursor_line_ref->prev;
-	te->cursor_line_num--;
-	
-	// Handle Scrolling up
-	if (te->cursor_line_num < te->row_offset) {
-		te->row_offset--;
+	te->hl_frontier = job->first_line + job->count;
+	te->hl_resume_line = line;
+	te->hl_resume_state = job->states[job->count];
+
+	// Past every edit, a line that already starts in the state we reached means the
+	// rest of the file is unchanged from the last pass
+	if (line && te->hl_frontier > te->hl_dirty_end && line->hl_known && line->hl_state_in == te->hl_resume_state) {
+		te->hl_frontier = te->line_count;
+	}
+	if (te->hl_frontier >= te->line_count) {
+		te->hl_resume_line = NULL;
+		te->hl_dirty_end = 0;
 	}
+	return visible;
 }
 
-void editor_cursor_down(TextEditor* te){
-	
-	handle_cursor_line_move(te, te->cursor_line_ref, te->cursor_line_ref->next );
-	te->cursor_line_ref = te->cursor_line_ref->next;
-	te->cursor_line_num++;
 
+// State shared by the event handlers of the interactive editor
+typedef struct {
+	BufferList* bl;
+	InputQueue input;
+	KeyMacro macro;
+	int frame_timer;
+	long frame_ms;
+	long last_frame;
+	int frame_pending;
+	long last_input;
+	HighlightWorker highlighter;
+	int highlighter_fd;
+	int highlighting;           // The worker thread is running
+} EditorSession;
+
+// Schedules a redraw no sooner than frame_ms after the previous one
+void session_request_frame(EditorSession* s){
+	if (s->frame_pending) return;
+	s->frame_pending = 1;
+	ev_timer_set(s->frame_timer, s->last_frame + s->frame_ms - monotonic_ms(), 0);
+}
 
-	// Handle Scrolling down
-	if (te->cursor_line_num >= te->row_offset + te->term_height) {
-		te->row_offset++;
+// Applies every complete key in the input queue. Returns 0 once the user quits
+int session_process_input(EditorSession* s){
+	char key[3];
+	int len;
+
+	while ((len = input_next_key(&s->input, key)) > 0) {
+		if (!editor_handle_key(s->bl, &s->macro, key, len)) return 0;
 	}
+	s->last_input = monotonic_ms();
+	if (s->highlighting) editor_hl_schedule(bl_active(s->bl), &s->highlighter);
+	session_request_frame(s);
+	return 1;
 }
 
+// Drains all pending input before drawing so fast key-repeat never queues up frames
+void on_input(EventLoop* loop, int fd, void* data){
+	EditorSession* s = data;
 
-void editor_print_text(TextEditor* te) {
-    LineNode* current = te->head;
-    int line_number = 1;
+	if (input_fill(&s->input) == 0) { // Readable but empty: end of input
+		loop->running = 0;
+		return;
+	}
+	if (!session_process_input(s)) loop->running = 0;
+}
 
-    while (current != NULL) {
-        printf("Line %d: ", line_number);
-		printf("%s\n", gb_render(current->text));
-        // gb_print(current->text);
-        current = current->next;
-        line_number++;
-    }
+// Finished highlight jobs: store the results, then keep the pass going
+void on_highlight_done(EventLoop* loop, int fd, void* data){
+	EditorSession* s = data;
+	ev_drain(fd);
+
+	pthread_mutex_lock(&s->highlighter.lock);
+	HighlightJob* done = s->highlighter.done;
+	s->highlighter.done = NULL;
+	pthread_mutex_unlock(&s->highlighter.lock);
+
+	while (done) {
+		HighlightJob* next = done->next;
+		if (editor_hl_apply(done->te, done) && done->te == bl_active(s->bl)) {
+			done->te->full_redraw = 1;
+			session_request_frame(s);
+		}
+		hl_job_free(done);
+		done = next;
+	}
+	editor_hl_schedule(bl_active(s->bl), &s->highlighter);
+}
+
+void on_frame(EventLoop* loop, int fd, void* data){
+	EditorSession* s = data;
+	ev_drain(fd);
+
+	TextEditor* te = bl_active(s->bl);
+	editor_cold_maintain(te);
+	editor_render(te);
+	s->last_frame = monotonic_ms();
+	s->frame_pending = 0;
+}
+
+void on_file_change(EventLoop* loop, int fd, void* data){
+	EditorSession* s = data;
+	for (int i = 0; i < s->bl->count; i++) {
+		TextEditor* te = s->bl->buffers[i];
+		if (te->watch_fd != fd) continue;
+		if (editor_check_file_changes(te) && i == s->bl->active) {
+			if (s->highlighting) editor_hl_schedule(te, &s->highlighter);
+			session_request_frame(s);
+		}
+	}
+}
+
+// The buffers' terminal sizes were just updated: keep the cursors in view and repaint
+void session_resized(EditorSession* s){
+	for (int i = 0; i < s->bl->count; i++) {
+		TextEditor* te = s->bl->buffers[i];
+		if (te->cursor_line_num >= te->row_offset + te->term_height) {
+			te->row_offset = te->cursor_line_num - te->term_height + 1;
+		}
+		te->full_redraw = 1;
+	}
+	editor_scroll_to_cursor(bl_active(s->bl));
+	editor_write(bl_active(s->bl), CLEAR_HOME, strlen(CLEAR_HOME));
+	session_request_frame(s);
+}
+
+void on_resize(EventLoop* loop, int fd, void* data){
+	EditorSession* s = data;
+	ev_drain(fd);
+
+	for (int i = 0; i < s->bl->count; i++) editor_update_terminal_dim(s->bl->buffers[i]);
+	session_resized(s);
+}
+
+// Periodic housekeeping, skipped while the user is typing
+void on_idle(EventLoop* loop, int fd, void* data){
+	EditorSession* s = data;
+	ev_drain(fd);
+	if (monotonic_ms() - s->last_input < BUFFER_IDLE_SECS * 1000 / 4) return;
+
+	bl_compact_idle(s->bl);
+	editor_cold_sweep(bl_active(s->bl));
+}
+
+// Sets up the frame timer and highlight worker of an editing session on loop.
+// Any signals the loop handles must be registered first so the worker inherits the mask
+void session_init(EditorSession* s, EventLoop* loop, BufferList* bl, int fps){
+	s->bl = bl;
+	input_init(&s->input);
+	macro_init(&s->macro);
+	s->frame_ms = fps > 0 ? 1000 / fps : 0;
+	s->last_frame = 0;
+	s->frame_pending = 0;
+	s->last_input = 0;
+
+	s->frame_timer = ev_add_timer(loop, -1, 0, on_frame, s);
+	if (s->frame_timer < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+
+	s->highlighter_fd = ev_add_wakeup(loop, on_highlight_done, s);
+	s->highlighting = s->highlighter_fd >= 0 && hl_worker_start(&s->highlighter, s->highlighter_fd);
+	if (s->highlighting) editor_hl_schedule(bl_active(bl), &s->highlighter);
+}
+
+void session_free(EditorSession* s, EventLoop* loop){
+	if (s->highlighting) hl_worker_stop(&s->highlighter);
+	ev_remove(loop, s->highlighter_fd);
+	ev_remove(loop, s->frame_timer);
+	macro_free(&s->macro);
+}
+
+// Draws at most fps frames a second (fps <= 0 is uncapped)
+void editor_action_loop(BufferList* bl, int fps){
+	EventLoop loop;
+	ev_init(&loop);
+
+	EditorSession s;
+	ev_add(&loop, STDIN_FILENO, on_input, &s, 0);
+	ev_add_signal(&loop, SIGWINCH, on_resize, &s);
+	ev_add_timer(&loop, BUFFER_IDLE_SECS * 1000 / 4, BUFFER_IDLE_SECS * 1000 / 4, on_idle, &s);
+	for (int i = 0; i < bl->count; i++) {
+		ev_add(&loop, bl->buffers[i]->watch_fd, on_file_change, &s, 0);
+	}
+	session_init(&s, &loop, bl, fps);
+
+	ev_run(&loop);
+
+	session_free(&s, &loop);
+	ev_free(&loop);
 }
 
 
+// Editor server. `--server` keeps every document it opens resident (lines, cold blocks,
+// highlight states, journal) so opening a file again is instant. A normal launch first
+// tries to attach to a running server as a thin client: it forwards keystrokes and
+// terminal sizes over a Unix socket and copies the frames the server renders straight
+// to the terminal. Those are the same damage-only updates a standalone editor draws.
+// Without a server the editor runs standalone.
+
+#define CLIENT_MSG_MAX 4096
+
 typedef enum {
-    HL_NORMAL,
-    HL_KEYWORD,
-    HL_STRING,
-    HL_COMMENT,
-    HL_NUMBER,
-} HighlightType;
+	MSG_OPEN = 1,               // Absolute path of a file to edit
+	MSG_START,                  // ClientSize; sent once after the MSG_OPENs
+	MSG_KEYS,                   // Raw terminal input
+	MSG_RESIZE,                 // ClientSize
+	MSG_FOLLOW,                 // No payload, sent first: tail-follow the files opened
+} ClientMsgType;
 
-void editor_add_highlight(OutBuffer* ob, HighlightType type, char c){
-	switch (type) {
-		case HL_KEYWORD:
-			ob_append(ob, "\033[1;32m", 7); // Green
-			break;
-		case HL_STRING:
-			ob_append(ob, "\033[1;33m", 7); // Yellow
+typedef struct {
+	uint32_t type;
+	uint32_t size;              // Payload bytes following the header
+} ClientMsg;
+
+typedef struct {
+	uint16_t rows;
+	uint16_t cols;
+} ClientSize;
+
+// A directory only this user can reach: $XDG_RUNTIME_DIR, or a private one in /tmp
+int server_socket_dir(char* dir, size_t size){
+	const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir && runtime_dir[0]) snprintf(dir, size, "%s", runtime_dir);
+	else {
+		snprintf(dir, size, "/tmp/editor-%d", (int)getuid());
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST) return 0;
+	}
+
+	// Anyone could have made it first, so trust it only if it is ours and closed to others
+	struct stat st;
+	if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+		fprintf(stderr, "Not using %s for the server socket: not a private directory\n", dir);
+		return 0;
+	}
+	return 1;
+}
+
+int server_socket_addr(struct sockaddr_un* addr){
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	char dir[sizeof(addr->sun_path) + 1];
+	char path[sizeof(addr->sun_path) + 16];
+	if (!server_socket_dir(dir, sizeof(dir))) return 0;
+	snprintf(path, sizeof(path), "%s/editor.sock", dir);
+	if (strlen(path) >= sizeof(addr->sun_path)) return 0;
+	strcpy(addr->sun_path, path);
+	return 1;
+}
+
+// The other end of a connected socket runs as this user
+int socket_peer_is_us(int fd){
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return 0;
+	return cred.uid == getuid();
+}
+
+typedef struct ClientSession ClientSession;
+
+typedef struct {
+	EventLoop loop;
+	BufferList docs;            // Every document opened so far, attached or not
+	ClientSession* clients;
+	int listen_fd;
+	int fps;
+} EditorServer;
+
+struct ClientSession {
+	EditorSession session;      // First, so the session handlers can be given a client
+	EditorServer* server;
+	ClientSession* next;
+	int fd;
+	BufferList view;            // The client's documents, borrowed from server->docs
+	char* rx;                   // Received bytes not yet forming a whole message
+	int rx_size;
+	int rx_cap;
+	OutQueue out;               // Frames the client has not read yet
+	int follow;                 // Documents it opens are put in follow mode
+	int started;
+};
+
+void on_server_file_change(EventLoop* loop, int fd, void* data){
+	EditorServer* server = data;
+	for (int i = 0; i < server->docs.count; i++) {
+		TextEditor* te = server->docs.buffers[i];
+		if (te->watch_fd != fd || !editor_check_file_changes(te)) continue;
+
+		for (ClientSession* c = server->clients; c; c = c->next) {
+			if (!c->started || bl_active(&c->view) != te) continue;
+			if (c->session.highlighting) editor_hl_schedule(te, &c->session.highlighter);
+			session_request_frame(&c->session);
+		}
+	}
+}
+
+void client_session_close(ClientSession* c){
+	EditorServer* server = c->server;
+	if (c->started) {
+		write(c->fd, CLEAR_HOME, strlen(CLEAR_HOME));
+		session_free(&c->session, &server->loop);
+	}
+
+	// Detached documents stay loaded, idle compaction reclaims them eventually
+	for (int i = 0; i < c->view.count; i++) {
+		TextEditor* te = c->view.buffers[i];
+		te->attached = 0;
+		te->out_fd = -1;
+		te->out_queue = NULL;
+		te->last_active = time(NULL);
+		te->mem_bytes = editor_memory_usage(te);
+	}
+	free(c->view.buffers);
+
+	ClientSession** link = &server->clients;
+	while (*link != c) link = &(*link)->next;
+	*link = c->next;
+
+	ev_remove(&server->loop, c->fd);
+	close(c->fd);
+	free(c->rx);
+	free(c->out.pending.buffer);
+	free(c);
+}
+
+// Tell the client why it cannot attach and hang up
+void client_session_refuse(ClientSession* c, const char* reason, const char* filename){
+	char message[4096];
+	int len = snprintf(message, sizeof(message), "%s: %s\r\n", reason, filename);
+	write(c->fd, message, len < (int)sizeof(message) ? len : (int)sizeof(message) - 1);
+	client_session_close(c);
+}
+
+// Returns 0 if the client was refused and closed
+int client_session_open(ClientSession* c, const char* filename){
+	EditorServer* server = c->server;
+	int known = server->docs.count;
+	int index = bl_open(&server->docs, filename);
+	if (index < 0) {
+		client_session_refuse(c, "Cannot open", filename);
+		return 0;
+	}
+	TextEditor* te = server->docs.buffers[index];
+	if (index >= known) ev_add(&server->loop, te->watch_fd, on_server_file_change, server, 0);
+
+	for (int i = 0; i < c->view.count; i++) {
+		if (c->view.buffers[i] == te) return 1;
+	}
+	if (te->attached) {
+		client_session_refuse(c, "Already open in another client", filename);
+		return 0;
+	}
+	if (!editor_restore(te)) {
+		client_session_refuse(c, "Cannot open", filename);
+		return 0;
+	}
+
+	te->attached = 1;
+	te->out_fd = c->fd;
+	te->out_queue = &c->out;
+	te->full_redraw = 1;
+	te->last_active = time(NULL);
+	if (c->view.count == c->view.cap) {
+		c->view.cap = c->view.cap ? c->view.cap * 2 : 4;
+		c->view.buffers = realloc(c->view.buffers, sizeof(TextEditor*) * c->view.cap);
+		if (!c->view.buffers) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	c->view.buffers[c->view.count++] = te;
+	if (c->follow && !te->follow) editor_toggle_follow(te);
+	return 1;
+}
+
+void client_session_size(ClientSession* c, const ClientSize* size){
+	for (int i = 0; i < c->view.count; i++) {
+		c->view.buffers[i]->term_height = size->rows;
+		c->view.buffers[i]->term_width = size->cols;
+	}
+}
+
+// Returns 0 if the message ended the session
+int client_session_message(ClientSession* c, const ClientMsg* msg, const char* payload){
+	EditorSession* s = &c->session;
+	char filename[CLIENT_MSG_MAX + 1];
+	ClientSize size; // Copied out, the payload sits at any offset in the receive buffer
+
+	switch (msg->type) {
+		case MSG_OPEN:
+			if (c->started) break;
+			memcpy(filename, payload, msg->size);
+			filename[msg->size] = '\0';
+			return client_session_open(c, filename);
+
+		case MSG_START:
+			if (c->started || msg->size != sizeof(ClientSize) || c->view.count == 0) {
+				client_session_close(c);
+				return 0;
+			}
+			memcpy(&size, payload, sizeof(size));
+			client_session_size(c, &size);
+			session_init(s, &c->server->loop, &c->view, c->server->fps);
+			c->started = 1;
+			session_resized(s);
 			break;
-		case HL_COMMENT:
-			ob_append(ob, "\033[1;30m", 7); // Gray
+
+		case MSG_FOLLOW:
+			if (!c->started) c->follow = 1;
 			break;
-		case HL_NUMBER:
-			ob_append(ob, "\033[1;31m", 7); // Red
+
+		case MSG_RESIZE:
+			if (!c->started || msg->size != sizeof(ClientSize)) break;
+			memcpy(&size, payload, sizeof(size));
+			client_session_size(c, &size);
+			session_resized(s);
 			break;
-		default:
-			ob_append(ob, "\033[0m", 4); // Reset
+
+		case MSG_KEYS:
+			if (!c->started) break;
+			// Partial escape sequences stay queued until the rest arrives
+			for (uint32_t done = 0; done < msg->size; ) {
+				input_compact(&s->input);
+				int n = msg->size - done;
+				if (n > INPUT_BUF_SZ - s->input.end) n = INPUT_BUF_SZ - s->input.end;
+				memcpy(s->input.buffer + s->input.end, payload + done, n);
+				s->input.end += n;
+				done += n;
+				if (!session_process_input(s)) {
+					client_session_close(c);
+					return 0;
+				}
+			}
 			break;
 	}
+	return 1;
+}
+
+// Sends what the client could not take earlier. Returns 0 once the client is gone
+// or so far behind that it has to be dropped
+int client_session_flush(ClientSession* c){
+	OutBuffer* pending = &c->out.pending;
+	size_t done = 0;
+	while (done < pending->size) {
+		ssize_t n = write(c->fd, pending->buffer + done, pending->size - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) break;
+		if (n <= 0) return 0;
+		done += n;
+	}
+	memmove(pending->buffer, pending->buffer + done, pending->size - done);
+	pending->size -= done;
+	return !c->out.overflow;
+}
+
+// Edge triggered: runs when the client sent something or has room for more output,
+// so both are taken care of in full each time
+void on_client_data(EventLoop* loop, int fd, void* data){
+	ClientSession* c = data;
+	if (!client_session_flush(c)) {
+		client_session_close(c);
+		return;
+	}
+
+	for (;;) {
+		if (c->rx_cap - c->rx_size < CLIENT_MSG_MAX) {
+			c->rx_cap = c->rx_size + CLIENT_MSG_MAX * 2;
+			c->rx = realloc(c->rx, c->rx_cap);
+			if (!c->rx) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ssize_t n = read(fd, c->rx + c->rx_size, c->rx_cap - c->rx_size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) break;
+		if (n <= 0) {
+			client_session_close(c);
+			return;
+		}
+		c->rx_size += n;
+
+		int offset = 0;
+		while (c->rx_size - offset >= (int)sizeof(ClientMsg)) {
+			ClientMsg msg;
+			memcpy(&msg, c->rx + offset, sizeof(msg));
+			if (msg.size > CLIENT_MSG_MAX) {
+				client_session_close(c);
+				return;
+			}
+			if (c->rx_size - offset < (int)(sizeof(msg) + msg.size)) break;
+
+			if (!client_session_message(c, &msg, c->rx + offset + sizeof(msg))) return;
+			offset += sizeof(msg) + msg.size;
+		}
+		memmove(c->rx, c->rx + offset, c->rx_size - offset);
+		c->rx_size -= offset;
+	}
+	if (c->out.overflow) client_session_close(c);
+}
+
+void on_client_connect(EventLoop* loop, int fd, void* data){
+	EditorServer* server = data;
+	int client_fd;
+
+	// A client that stops reading must not stall the others: its frames queue up instead
+	while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (!socket_peer_is_us(client_fd)) {
+			close(client_fd);
+			continue;
+		}
+
+		ClientSession* c = malloc(sizeof(ClientSession));
+		if (!c) {
+			perror("malloc");
+			exit(1);
+		}
+		c->server = server;
+		c->fd = client_fd;
+		bl_init(&c->view);
+		c->rx = NULL;
+		c->rx_size = 0;
+		c->rx_cap = 0;
+		ob_init(&c->out.pending);
+		c->out.overflow = 0;
+		c->follow = 0;
+		c->started = 0;
+		c->next = server->clients;
+		server->clients = c;
+		ev_add_events(loop, client_fd, EPOLLIN | EPOLLOUT | EPOLLET, on_client_data, c, 0);
+	}
+}
+
+void on_server_idle(EventLoop* loop, int fd, void* data){
+	EditorServer* server = data;
+	ev_drain(fd);
+
+	// Clients that overflowed without ever becoming writable again
+	ClientSession* c = server->clients;
+	while (c) {
+		ClientSession* next = c->next;
+		if (c->out.overflow) client_session_close(c);
+		c = next;
+	}
+
+	bl_compact_idle(&server->docs);
+	for (ClientSession* c = server->clients; c; c = c->next) {
+		if (c->started && monotonic_ms() - c->session.last_input >= BUFFER_IDLE_SECS * 1000 / 4) {
+			editor_cold_sweep(bl_active(&c->view));
+		}
+	}
+}
+
+void on_server_stop(EventLoop* loop, int fd, void* data){
+	ev_drain(fd);
+	loop->running = 0;
+}
+
+// Runs until SIGINT or SIGTERM. Returns 1 if the socket could not be set up
+int server_run(int fps){
+	struct sockaddr_un addr;
+	if (!server_socket_addr(&addr)) {
+		fprintf(stderr, "No usable path for the server socket\n");
+		return 1;
+	}
+
+	// A socket nobody answers on is left over from a server that died
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "A server is already listening on %s\n", addr.sun_path);
+		close(probe);
+		return 1;
+	}
+	if (probe >= 0) close(probe);
+	unlink(addr.sun_path);
+
+	// The socket is created 0600, there is no window where others can connect
+	EditorServer server;
+	mode_t old_umask = umask(0077);
+	server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int bound = server.listen_fd >= 0 && bind(server.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	umask(old_umask);
+	if (!bound || listen(server.listen_fd, 16) < 0) {
+		perror("server socket");
+		if (server.listen_fd >= 0) close(server.listen_fd);
+		return 1;
+	}
+
+	// A client that goes away mid-frame must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	ev_init(&server.loop);
+	bl_init(&server.docs);
+	server.docs.active = -1; // Clients hold their documents attached, none is active here
+	server.clients = NULL;
+	server.fps = fps;
+	ev_add(&server.loop, server.listen_fd, on_client_connect, &server, 1);
+	ev_add_signal(&server.loop, SIGINT, on_server_stop, &server);
+	ev_add_signal(&server.loop, SIGTERM, on_server_stop, &server);
+	ev_add_timer(&server.loop, BUFFER_IDLE_SECS * 1000 / 4, BUFFER_IDLE_SECS * 1000 / 4, on_server_idle, &server);
+
+	ev_run(&server.loop);
+
+	while (server.clients) client_session_close(server.clients);
+	bl_free(&server.docs);
+	ev_free(&server.loop);
+	unlink(addr.sun_path);
+	return 0;
+}
+
+int client_send(int fd, int type, const void* payload, int size){
+	ClientMsg msg = {type, size};
+	return write_all(fd, (const char*)&msg, sizeof(msg)) && write_all(fd, payload, size);
+}
+
+void client_send_size(int fd, int type){
+	struct winsize ws;
+	ClientSize size = {24, 80};
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+		size.rows = ws.ws_row;
+		size.cols = ws.ws_col;
+	}
+	client_send(fd, type, &size, sizeof(size));
+}
 
-        ob_append(ob, &c, 1); // Add the character
-        ob_append(ob, "\033[0m", 4);    // Reset after each character
+// Returns a socket connected to a running server, -1 if there is none
+int client_connect(){
+	struct sockaddr_un addr;
+	if (!server_socket_addr(&addr)) return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (!socket_peer_is_us(fd)) {
+		fprintf(stderr, "Not attaching to %s: the server runs as another user\n", addr.sun_path);
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 
-void editor_render_line(TextEditor* te, OutBuffer* ob, LineNode* line){
-        // Render the line text from gap buffer
-        char* line_text = gb_render(line->text);
-		int line_length = strlen(line_text);
+void on_client_keys(EventLoop* loop, int fd, void* data){
+	int server_fd = *(int*)data;
+	char keys[INPUT_BUF_SZ];
+	ssize_t n = read(fd, keys, sizeof(keys));
+	if (n <= 0 || !client_send(server_fd, MSG_KEYS, keys, n)) loop->running = 0;
+}
 
-		// Outside visible range
-		if(line_length < te->col_offset){
-			free(line_text);
-			return;
-		}
+void on_client_resize(EventLoop* loop, int fd, void* data){
+	ev_drain(fd);
+	client_send_size(*(int*)data, MSG_RESIZE);
+}
 
+// Frames from the server go to the terminal untouched
+void on_server_output(EventLoop* loop, int fd, void* data){
+	char frame[65536];
+	ssize_t n = read(fd, frame, sizeof(frame));
+	if (n <= 0 || !write_all(STDOUT_FILENO, frame, n)) loop->running = 0;
+}
 
-        // Only render the visible range
-		int render_start = te->col_offset;
-		int render_length = (line_length - render_start > te->term_width - te->line_number_width)
-								? te->term_width - te->line_number_width
-								: line_length - render_start;
-		//
-		// for(int i = 0; i < render_length; i++){
-		// 	char curr_char = line_text[render_start + i];
-		//
-		//
-		//
-  //           if (curr_char == '"') {
-  //               // Start of a string
-  //               editor_add_highlight(ob, HL_STRING, curr_char);
-		// 		i++; // Move to the next character
-		// 		// Parse the string
-		// 		while (i < render_length) {
-		// 			curr_char = line_text[render_start + i];
-		//
-		// 			 if (curr_char == '"') {
-		// 				editor_add_highlight(ob, HL_STRING, curr_char); // Highlight closing quote
-		// 				break; // End of string
-		// 			} else {
-		// 				editor_add_highlight(ob, HL_STRING, curr_char); // Highlight string content
-		// 			}
-		//
-		// 			i++;
-		// 		}
-  //           } else {
-  //               // Handle other types of syntax highlighting (e.g., keywords, numbers)
-		// 		 if (isdigit(curr_char)) {
-  //                   editor_add_highlight(ob, HL_NUMBER, curr_char);
-  //               } else {
-  //                   editor_add_highlight(ob, HL_NORMAL, curr_char);
-  //               }
-  //           }
-		// }
+// Edit filenames on the server behind fd until the user quits or the server goes away
+void client_run(int fd, char** filenames, int count, int follow){
+	if (follow) client_send(fd, MSG_FOLLOW, NULL, 0);
+	for (int i = 0; i < count; i++) {
+		char* path = realpath(filenames[i], NULL);
+		const char* name = path ? path : filenames[i];
+		client_send(fd, MSG_OPEN, name, strlen(name));
+		free(path);
+	}
+
+	EventLoop loop;
+	ev_init(&loop);
+	ev_add(&loop, STDIN_FILENO, on_client_keys, &fd, 0);
+	ev_add(&loop, fd, on_server_output, &fd, 0);
+	ev_add_signal(&loop, SIGWINCH, on_client_resize, &fd);
+	client_send_size(fd, MSG_START);
 
-		ob_append(ob, line_text + render_start, render_length);
-        
+	ev_run(&loop);
 
-        free(line_text);
+	ev_free(&loop);
+	close(fd);
 }
 
 
-#define MOVE_HOME "\033[H"
-#define CLEAR_HOME "\033[H\033[2J"
-#define NEW_LINE "\033[1E"
-#define CLEAR_LINE "\033[K"
-void editor_render(TextEditor* te){
 
-    OutBuffer ob;
-    ob_init(&ob);
 
+// Benchmark: --bench KIND SIZE writes a synthetic document, drives a random editing
+// workload at it through the same key handling and rendering as a session, and
+// checks the buffer against a plain reference model so a faster engine cannot
+// silently corrupt text
 
-    // Set the cursor type to vertical bar 
-    write(STDOUT_FILENO, "\033[5 q", strlen("\033[5 q"));
+#define BENCH_MAX_BYTES (1L << 30) // Line sizes and offsets are ints
+#define BENCH_CHUNK (16 << 20)
+#define BENCH_CHECK_EVERY 1024
+#define BENCH_ROWS 40
+#define BENCH_COLS 120
 
-	
-    LineNode* current = te->head;
-    int current_line_num = 0;
-    int visible_lines = 0;
+typedef enum {
+	BENCH_CODE,
+	BENCH_LOG,
+	BENCH_GIANT,                // One line of words
+	BENCH_TINY,                 // Lines of up to 8 bytes
+	BENCH_KIND_COUNT,
+} BenchKind;
 
-    // Skip lines until the viewport starts
-    while (current && current_line_num < te->row_offset) {
-        current = current->next;
-        current_line_num++;
-    }
+static const char* const bench_kind_names[] = {"code", "log", "giant", "tiny"};
+static const char* const bench_kind_files[] = {"doc.c", "doc.log", "giant.txt", "tiny.txt"};
 
-    while (current != NULL && visible_lines < te->term_height) {
-        // Move cursor to the start of the line
-        char cursor_move[32];
-        snprintf(cursor_move, sizeof(cursor_move), "\033[%d;1H", visible_lines + 1);
-        ob_append(&ob, cursor_move, strlen(cursor_move));
+typedef enum {
+	BENCH_TYPE,
+	BENCH_NEWLINE,
+	BENCH_BACKSPACE,
+	BENCH_MOVE,                 // Left or right
+	BENCH_SCROLL,               // A screen of up or down arrows
+	BENCH_JUMP,                 // To a random line, as a search would
+	BENCH_APPEND,               // Lines written to the end of the file, read as follow mode does
+	BENCH_OP_COUNT,
+} BenchOp;
+
+static const char* const bench_op_names[] = {"type", "newline", "backspace", "move", "scroll", "jump", "append"};
+static const int bench_op_weights[] = {53, 8, 20, 8, 7, 2, 2}; // Percent
+static const char bench_typed[] = "abcdefghijklmnopqrstuvwxyz _(){};=+";
+
+// xorshift64, state must not be 0
+uint64_t bench_rand(uint64_t* state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
 
-        // Clear the line
-        ob_append(&ob, CLEAR_LINE, strlen(CLEAR_LINE));
+long bench_now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
 
-		// Add line number to editor 
-		char editor_line_num[64];
+// Resident memory of the whole process
+long bench_rss_bytes(){
+	long pages = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (!file) return 0;
+	if (fscanf(file, "%*d %ld", &pages) != 1) pages = 0;
+	fclose(file);
+	return pages * sysconf(_SC_PAGESIZE);
+}
 
-		if (current_line_num == te->cursor_line_num) {
-			snprintf(editor_line_num, sizeof(editor_line_num), "\033[93;1m%4d \033[0m", current_line_num + 1); // Bright yellow, bold
-		} else {
-			snprintf(editor_line_num, sizeof(editor_line_num), "\033[90m%4d \033[0m", current_line_num + 1); // Dark gray
+// "64K", "512M", "1G" or plain bytes, -1 if it is none of those
+long bench_parse_size(const char* text){
+	char* end;
+	long size = strtol(text, &end, 10);
+	if (*end == '\0') return size;
+	if (end[1] != '\0') return -1;
+	switch (toupper((unsigned char)*end)) {
+		case 'K': return size << 10;
+		case 'M': return size << 20;
+		case 'G': return size << 30;
+	}
+	return -1;
+}
+
+typedef struct {
+	BenchKind kind;
+	uint64_t rng;
+	int depth;                  // Nesting of the code being written
+	long count;                 // Lines written so far
+} BenchGen;
+
+// Write the next line (a word, for the giant line) to out, which has room for 256 bytes
+int bench_gen_line(BenchGen* g, char* out){
+	uint64_t r = bench_rand(&g->rng);
+	long n = g->count++;
+
+	switch (g->kind) {
+		case BENCH_CODE: {
+			if (g->depth == 0) {
+				g->depth = 1;
+				return sprintf(out, "int func_%ld(int a, int b) {\n", n);
+			}
+			int pick = r % 12;
+			if (pick == 1) g->depth--; // A closing brace sits at the outer level
+			int indent = g->depth * 4;
+			memset(out, ' ', indent);
+			char* p = out + indent;
+			if (pick == 0 && g->depth < 6) {
+				g->depth++;
+				return indent + sprintf(p, "if (a > %d) {\n", (int)(r >> 16 & 0xfff));
+			}
+			if (pick == 1) return indent + sprintf(p, "}\n");
+			if (pick == 2) return indent + sprintf(p, "// Step %ld keeps b in range\n", n);
+			if (pick == 3) return sprintf(out, "\n");
+			return indent + sprintf(p, "b = compute(a, %d) + b * %d;\n", (int)(r >> 16 & 0xff), (int)(r >> 32 & 0xf));
+		}
+		case BENCH_LOG: {
+			static const char* const levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+			long ms = n * 37;
+			return sprintf(out, "2026-10-19 %02ld:%02ld:%02ld.%03ld %-5s [worker-%d] GET /api/items/%d %d %dms\n",
+				ms / 3600000 % 24, ms / 60000 % 60, ms / 1000 % 60, ms % 1000, levels[r % 6],
+				(int)(r >> 8 & 0xf), (int)(r >> 16 & 0xffff), (r >> 40) % 20 ? 200 : 404, (int)(r >> 48 & 0x1ff));
+		}
+		case BENCH_GIANT:
+			return sprintf(out, "word%d ", (int)(r >> 16 & 0xffff));
+		default: {
+			int size = r % 9;
+			for (int i = 0; i < size; i++) out[i] = 'a' + (r >> (8 + i * 5)) % 26;
+			out[size] = '\n';
+			return size + 1;
 		}
-		ob_append(&ob, editor_line_num, strlen(editor_line_num));
+	}
+}
 
-  //       // Render the line text
-  //       char* line_text = gb_render(current->text);
-		// int line_length = strlen(line_text);
-		//
-  //       // Calculate the visible range
-  //       if (te->col_offset < line_length) {
-  //           int render_start = te->col_offset;
-  //           int render_length = (line_length - render_start > te->term_width - te->line_number_width)
-  //                                   ? te->term_width - te->line_number_width
-  //                                   : line_length - render_start;
-  //           ob_append(&ob, line_text + render_start, render_length);
-  //       }
-		//
-  //       free(line_text);
+// Write size bytes of kind to path, the last line cut wherever the size runs out
+int bench_generate(const char* path, BenchKind kind, long size, uint64_t seed){
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		perror(path);
+		return 0;
+	}
+	char* chunk = malloc(BENCH_CHUNK + 256);
+	if (!chunk) {
+		perror("malloc");
+		exit(1);
+	}
 
-		editor_render_line(te, &ob, current);
+	BenchGen gen = {kind, seed, 0, 0};
+	long written = 0;
+	while (written < size) {
+		long used = 0;
+		while (used < BENCH_CHUNK) used += bench_gen_line(&gen, chunk + used);
+		if (used > size - written) used = size - written;
+		if (fwrite(chunk, 1, used, file) != (size_t)used) {
+			perror(path);
+			free(chunk);
+			fclose(file);
+			return 0;
+		}
+		written += used;
+	}
+	free(chunk);
+	return fclose(file) == 0;
+}
 
-        current = current->next;
-        current_line_num++;
-		visible_lines++;
+// One line of the reference model: borrowed from the generated file until it is first
+// edited, then a private copy with a gap at the last edit
+typedef struct {
+	char* text;
+	int size;
+	int cap;                    // 0 while borrowed
+	int gap;                    // Bytes before the gap, the size while borrowed
+} BenchLine;
+
+// Make l a private copy with room for extra more bytes
+void bench_line_reserve(BenchLine* l, int extra){
+	if (l->cap && l->cap - l->size >= extra) return;
+
+	int cap = l->size + l->size / 2 + extra + 16;
+	char* text = malloc(cap);
+	if (!text) {
+		perror("malloc");
+		exit(1);
 	}
+	int tail = l->size - l->gap;
+	memcpy(text, l->text, l->gap);
+	memcpy(text + cap - tail, l->text + l->cap - tail, tail);
+	if (l->cap) free(l->text);
+	l->text = text;
+	l->cap = cap;
+}
 
-    // Set cursor position
-    int adjusted_cursor_row = te->cursor_line_num - te->row_offset + 1;
-    int adjusted_cursor_col = te->cursor_pos  - te->col_offset + te->line_number_width + 1;
-    char cursor_position[32];
-    snprintf(cursor_position, sizeof(cursor_position), "\033[%d;%dH", adjusted_cursor_row, adjusted_cursor_col);
-    ob_append(&ob, cursor_position, strlen(cursor_position));
+void bench_line_move_gap(BenchLine* l, int pos){
+	int gap_size = l->cap - l->size;
+	if (pos < l->gap) memmove(l->text + pos + gap_size, l->text + pos, l->gap - pos);
+	else memmove(l->text + l->gap, l->text + l->gap + gap_size, pos - l->gap);
+	l->gap = pos;
+}
 
+void bench_line_insert(BenchLine* l, int pos, char c){
+	bench_line_reserve(l, 1);
+	bench_line_move_gap(l, pos);
+	l->text[l->gap++] = c;
+	l->size++;
+}
 
-    // Write the buffer to the terminal
-    write(STDOUT_FILENO, ob.buffer, ob.size);
-    free(ob.buffer);
+// Remove the byte before pos
+void bench_line_delete(BenchLine* l, int pos){
+	bench_line_reserve(l, 0);
+	bench_line_move_gap(l, pos);
+	l->gap--;
+	l->size--;
+}
 
+// Cut l at pos and return what came after it
+BenchLine bench_line_split(BenchLine* l, int pos){
+	if (!l->cap) { // Both halves can keep borrowing
+		BenchLine after = {l->text + pos, l->size - pos, 0, l->size - pos};
+		l->size = l->gap = pos;
+		return after;
+	}
 
+	bench_line_move_gap(l, pos);
+	BenchLine after = {l->text + l->cap - (l->size - pos), l->size - pos, 0, l->size - pos};
+	bench_line_reserve(&after, 0);
+	l->size = pos;
+	if (l->cap > 2 * pos + 64) { // Splitting a long line repeatedly must not keep copies of it
+		l->cap = pos + pos / 2 + 16;
+		l->text = realloc(l->text, l->cap);
+		if (!l->text) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	return after;
 }
 
+// Move the text of next onto the end of l
+void bench_line_append(BenchLine* l, BenchLine* next){
+	bench_line_reserve(l, next->size);
+	bench_line_move_gap(l, l->size);
+	int tail = next->size - next->gap;
+	memcpy(l->text + l->gap, next->text, next->gap);
+	memcpy(l->text + l->gap + next->gap, next->text + next->cap - tail, tail);
+	l->gap += next->size;
+	l->size += next->size;
+	if (next->cap) free(next->text);
+}
 
-void editor_action_loop(TextEditor* te){
-
+int bench_line_equals(BenchLine* l, const char* text, int size){
+	if (size != l->size) return 0;
+	if (size == 0) return 1; // Either side may have no buffer at all
 
-	int text_area_width = (te->term_width - te->line_number_width);
-	char c;
-	while (read(STDIN_FILENO, &c, 1) == 1 && c != 'q') {
-		if (c == '\033') { // Escape sequence
-			char seq[2];
-			if (read(STDIN_FILENO, &seq[0], 1) == 0) break;
-			if (read(STDIN_FILENO, &seq[1], 1) == 0) break;
+	int tail = l->size - l->gap;
+	return memcmp(l->text, text, l->gap) == 0 &&
+		memcmp(l->text + l->cap - tail, text + l->gap, tail) == 0;
+}
 
-			if (seq[0] == '[') {
-				switch (seq[1]) {
-					case 'A': // Up arrow
-						editor_cursor_up(te);
-						break;
-					case 'B': // Down arrow
-						editor_cursor_down(te);
-						break;
-					case 'D': // Left arrow
-                        if (te->cursor_pos > 0) {
-                            te->cursor_pos--;
-                            if (te->cursor_pos < te->col_offset) {
-                                te->col_offset = te->cursor_pos; // Scroll left
-                            }
-                        }
+// The reference model: every line in one array with a gap at the last line added or
+// removed, so splits and joins near the cursor stay cheap
+typedef struct {
+	BenchLine* lines;
+	int count;
+	int cap;
+	int gap;                    // Index of the first free slot
+	int line;                   // Cursor
+	int pos;
+	char* file;                 // The generated document, mapped
+	long file_size;
+} BenchModel;
+
+BenchLine* bench_model_line(BenchModel* m, int n){
+	return &m->lines[n < m->gap ? n : n + m->cap - m->count];
+}
 
-						break;
-					case 'C': // Right arrow
-                        if (te->cursor_pos < te->cursor_line_ref->text->logical_size) {
-                            te->cursor_pos++;
+void bench_model_move_gap(BenchModel* m, int n){
+	int gap_size = m->cap - m->count;
+	if (n < m->gap) memmove(m->lines + n + gap_size, m->lines + n, sizeof(BenchLine) * (m->gap - n));
+	else memmove(m->lines + m->gap, m->lines + m->gap + gap_size, sizeof(BenchLine) * (n - m->gap));
+	m->gap = n;
+}
 
-							if (te->cursor_pos >= te->col_offset + text_area_width) {
-								te->col_offset++; // Scroll right
-							}
+// Add line as number n
+void bench_model_insert(BenchModel* m, int n, BenchLine line){
+	if (m->count == m->cap) {
+		bench_model_move_gap(m, m->count);
+		m->cap = m->cap * 2 + 16;
+		m->lines = realloc(m->lines, sizeof(BenchLine) * m->cap);
+		if (!m->lines) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	bench_model_move_gap(m, n);
+	m->lines[m->gap++] = line;
+	m->count++;
+}
 
-                        }
-						break;
-					default:
-						printf("Unknown escape sequence: \\033[%c\n", seq[1]);
-						break;
-				}
-			}
-		} else if (iscntrl(c)) {
-			if (c == 127) { // Backspace
-                if (te->cursor_pos > 0) {
-                    editor_remove_char(te);
-                    te->cursor_pos--;
-                    if (te->cursor_pos < te->col_offset) {
-                        te->col_offset = te->cursor_pos; // Scroll left
-                    }
-                } else {
-					// Append anything before cursor on the line to prev line
-					LineNode* current_line = te->cursor_line_ref;
-					LineNode* prev_line = current_line->prev;
-
-					// Append current line's text to the previous line
-					char* current_text = gb_render(current_line->text);
-					int current_text_size = strlen(current_text);
-					gb_insert_chunk(prev_line->text, prev_line->text->logical_size, current_text, current_line->text->logical_size);
-					free(current_text);
-
-					// Update line references
-					prev_line->next = current_line->next;
-					if (current_line->next) {
-						current_line->next->prev = prev_line;
-					}
+// Drop line n, whose text has already been moved elsewhere
+void bench_model_remove(BenchModel* m, int n){
+	bench_model_move_gap(m, n + 1);
+	m->gap--;
+	m->count--;
+}
 
-					// Free the current line
-					gb_free(current_line->text);
-					free(current_line->text);
-					free(current_line);
+// Split the file into lines the way editor_set_text does
+int bench_model_load(BenchModel* m, const char* path){
+	memset(m, 0, sizeof(BenchModel));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0) close(fd);
+		return 0;
+	}
+	m->file_size = st.st_size;
+	m->file = m->file_size ? mmap(NULL, m->file_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (m->file == MAP_FAILED) {
+		perror("mmap");
+		return 0;
+	}
 
-					// Horizontal Scrolling
-					if(prev_line->text->logical_size - current_text_size >= text_area_width){
-						te->col_offset = (prev_line->text->logical_size - current_text_size) - text_area_width; // If prev line needs scrolling when moving to it
-					}
+	int count = 1;
+	for (char* p = m->file; (p = memchr(p, '\n', m->file + m->file_size - p)) != NULL; p++) count++;
+	m->cap = count + 1024;
+	m->lines = malloc(sizeof(BenchLine) * m->cap);
+	if (!m->lines) {
+		perror("malloc");
+		exit(1);
+	}
 
-					te->cursor_line_ref = prev_line;
-					te->cursor_line_num--;
-					te->cursor_pos = prev_line->text->logical_size - current_text_size;
-					te->line_count--;
+	long start = 0;
+	while (m->count < count) {
+		char* nl = memchr(m->file + start, '\n', m->file_size - start);
+		long end = nl ? nl - m->file : m->file_size;
+		BenchLine line = {m->file + start, end - start, 0, end - start};
+		m->lines[m->count++] = line;
+		start = end + 1;
+	}
+	m->gap = m->count;
+	return 1;
+}
 
+void bench_model_free(BenchModel* m){
+	for (int i = 0; i < m->count; i++) {
+		BenchLine* line = bench_model_line(m, i);
+		if (line->cap) free(line->text);
+	}
+	free(m->lines);
+	if (m->file) munmap(m->file, m->file_size);
+}
 
-				   // Adjust scrolling
-					if (te->cursor_line_num < te->row_offset) {
-						te->row_offset--;
-					}
-				}
+// Text appended to the file continues the last line, every newline in it starts a new one
+void bench_model_append(BenchModel* m, const char* text, int size){
+	BenchLine* line = bench_model_line(m, m->count - 1);
+	for (int i = 0; i < size; i++) {
+		if (text[i] == '\n') {
+			BenchLine empty = {malloc(16), 0, 16, 0};
+			if (!empty.text) {
+				perror("malloc");
+				exit(1);
 			}
+			bench_model_insert(m, m->count, empty);
+			line = bench_model_line(m, m->count - 1);
+		} else {
+			bench_line_insert(line, line->size, text[i]);
+		}
+	}
+}
 
-			if(c == 13){ // Enter
-				editor_insert_newline(te);
-			}
+// Compare the editor's line n with the model, reporting the first difference
+int bench_check_line(BenchModel* m, LineReader* r, LineNode* line, int n){
+	int size;
+	const char* text = line_reader_text(r, line, &size);
+	if (bench_line_equals(bench_model_line(m, n), text, size)) return 1;
 
-			if(c == 9){ // Tab
-				
-				int spaces_to_insert = TAB_WIDTH - (te->cursor_pos % TAB_WIDTH);
-				for (int i = 0; i < spaces_to_insert; i++) {
-					editor_insert_char(te, ' ');
-					te->cursor_pos++;
-					if (te->cursor_pos >= te->col_offset + text_area_width) {
-						te->col_offset++;
-					}
-				}
+	fprintf(stderr, "bench: line %d differs from the reference model (%d bytes, expected %d)\n",
+		n + 1, size, bench_model_line(m, n)->size);
+	return 0;
+}
 
-			}
-			printf("%d (control)\r\n", c);
+// Cheap check between operations: the cursor and the line it is on
+int bench_check_cursor(TextEditor* te, BenchModel* m){
+	if (te->line_count != m->count || te->cursor_line_num != m->line || te->cursor_pos != m->pos) {
+		fprintf(stderr, "bench: editor at %d:%d of %d lines, reference model at %d:%d of %d\n",
+			te->cursor_line_num + 1, te->cursor_pos, te->line_count, m->line + 1, m->pos, m->count);
+		return 0;
+	}
 
-		} else {
-			log_to_file("Char inserted: %d ('%c')", c, c);
-			editor_insert_char(te, c);
-			te->cursor_pos++;
+	LineReader r;
+	line_reader_init(&r);
+	int ok = bench_check_line(m, &r, te->cursor_line_ref, m->line);
+	line_reader_free(&r);
+	return ok;
+}
 
-			// Handle horrizontal scrolling
-			if (te->cursor_pos >= te->col_offset + text_area_width) {
-				te->col_offset++;
-				// te->col_offset = te->cursor_pos - (te->term_width - te->line_number_width) + 1; // Scroll right
+int bench_check_all(TextEditor* te, BenchModel* m){
+	if (!bench_check_cursor(te, m)) return 0;
+
+	LineReader r;
+	line_reader_init(&r);
+	int ok = 1;
+	int n = 0;
+	for (LineNode* line = te->head; ok && line != NULL; line = line->next, n++) {
+		ok = bench_check_line(m, &r, line, n);
+	}
+	line_reader_free(&r);
+	return ok;
+}
+
+// Apply one random operation to the model, then to the editor followed by the frame
+// it causes. Only the editor's part is timed
+long bench_step(BufferList* bl, BenchModel* m, BenchOp op, uint64_t* rng){
+	TextEditor* te = bl_active(bl);
+	BenchLine* line = bench_model_line(m, m->line);
+	uint64_t r = bench_rand(rng);
+	char key[4] = {0};
+	int key_len = 1;
+	int repeat = 1;
+	char* appended = NULL;
+	int appended_size = 0;
+
+	switch (op) {
+		case BENCH_TYPE:
+			key[0] = bench_typed[r % (sizeof(bench_typed) - 1)];
+			bench_line_insert(line, m->pos++, key[0]);
+			break;
+		case BENCH_NEWLINE:
+			key[0] = '\r';
+			bench_model_insert(m, m->line + 1, bench_line_split(line, m->pos));
+			m->line++;
+			m->pos = 0;
+			break;
+		case BENCH_BACKSPACE:
+			key[0] = 127;
+			if (m->pos > 0) {
+				bench_line_delete(line, m->pos--);
+			} else if (m->line > 0) {
+				BenchLine* prev = bench_model_line(m, m->line - 1);
+				m->pos = prev->size;
+				bench_line_append(prev, line);
+				bench_model_remove(m, m->line--);
+			}
+			break;
+		case BENCH_MOVE:
+			memcpy(key, r & 1 ? "\033[C" : "\033[D", 3);
+			key_len = 3;
+			if (r & 1) m->pos += m->pos < line->size;
+			else m->pos -= m->pos > 0;
+			break;
+		case BENCH_SCROLL: {
+			int up = r % 5 < 2;
+			memcpy(key, up ? "\033[A" : "\033[B", 3);
+			key_len = 3;
+			repeat = BENCH_ROWS;
+			for (int i = 0; i < repeat; i++) {
+				if (up ? m->line == 0 : m->line == m->count - 1) continue;
+				m->line += up ? -1 : 1;
+				int size = bench_model_line(m, m->line)->size;
+				if (m->pos > size) m->pos = size;
+			}
+			break;
+		}
+		case BENCH_JUMP:
+			m->line = r % m->count;
+			m->pos = (r >> 32) % (bench_model_line(m, m->line)->size + 1);
+			break;
+		case BENCH_APPEND: {
+			// Up to a block's worth of lines, so appends cross block boundaries often
+			int pinned = m->line == m->count - 1;
+			int lines = 1 + r % COLD_BLOCK_LINES;
+			appended = malloc(lines * 16);
+			if (!appended) {
+				perror("malloc");
+				exit(1);
+			}
+			for (int i = 0; i < lines; i++) appended_size += sprintf(appended + appended_size, "tail %d\n", i);
+			int fd = open(te->filename, O_WRONLY | O_APPEND | O_CLOEXEC);
+			if (fd < 0 || !write_all(fd, appended, appended_size)) {
+				perror(te->filename);
+				exit(1);
 			}
+			close(fd);
+			bench_model_append(m, appended, appended_size);
+			if (pinned) {
+				m->line = m->count - 1;
+				m->pos = bench_model_line(m, m->line)->size;
+			}
+			break;
 		}
+		default:
+			break;
+	}
 
-		editor_render(te);
+	long start = bench_now_ns();
+	if (op == BENCH_JUMP) {
+		LineNode* target = editor_line_at(te, m->line);
+		int size = line_gb(target)->logical_size;
+		editor_jump_to(te, target, m->line, m->pos < size ? m->pos : size);
+	} else if (op == BENCH_APPEND) {
+		editor_follow_read(te);
+	} else {
+		for (int i = 0; i < repeat; i++) editor_process_key(bl, key, key_len, 1);
 	}
+	editor_cold_maintain(te);
+	editor_render(te);
+	long elapsed = bench_now_ns() - start;
+	free(appended);
+	return elapsed;
 }
 
+int bench_compare_long(const void* a, const void* b){
+	long x = *(const long*)a;
+	long y = *(const long*)b;
+	return (x > y) - (x < y);
+}
 
+// Throughput and latency percentiles of one operation, sorts samples in place
+void bench_report_op(const char* name, long* samples, int count){
+	if (count == 0) return;
 
+	qsort(samples, count, sizeof(long), bench_compare_long);
+	long total = 0;
+	for (int i = 0; i < count; i++) total += samples[i];
+	printf("  %-10s %9d %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, count, count / (total / 1e9),
+		samples[count / 2] / 1e3, samples[count * 90L / 100] / 1e3, samples[count * 99L / 100] / 1e3,
+		samples[count * 999L / 1000] / 1e3, samples[count - 1] / 1e3);
+}
 
-char* read_file_to_str(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Error opening file");
-        return NULL;
-    }
+// Generate, load, run the workload and check one kind of document. Returns 0 on success
+int bench_run_kind(BenchKind kind, long size, int ops, uint64_t seed, const char* dir){
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", dir, bench_kind_files[kind]);
+
+	long generate_start = bench_now_ns();
+	if (!bench_generate(path, kind, size, seed)) return 1;
+	long load_start = bench_now_ns();
+	long rss_start = bench_rss_bytes();
+
+	BufferList bl;
+	bl_init(&bl);
+	if (bl_open(&bl, path) < 0) {
+		unlink(path);
+		return 1;
+	}
+	long load_end = bench_now_ns();
+	long rss_loaded = bench_rss_bytes();
+
+	TextEditor* te = bl_active(&bl);
+	te->out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	te->term_width = BENCH_COLS;
+	te->term_height = BENCH_ROWS;
+	size_t mem_loaded = editor_memory_usage(te);
+	printf("%s: %.1f MB in %d lines, generated in %.2fs, loaded in %.2fs\n", bench_kind_names[kind], size / 1048576.0,
+		te->line_count, (load_start - generate_start) / 1e9, (load_end - load_start) / 1e9);
+
+	BenchModel model;
+	if (!bench_model_load(&model, path)) {
+		close(te->out_fd);
+		bl_free(&bl);
+		unlink(path);
+		return 1;
+	}
 
-    // Seek to the end of the file to determine its size
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
+	long* samples = malloc(sizeof(long) * (ops > 0 ? ops : 1));
+	unsigned char* kinds = malloc(ops > 0 ? ops : 1);
+	if (!samples || !kinds) {
+		perror("malloc");
+		exit(1);
+	}
 
-    // Seek back to the beginning of the file
-    fseek(file, 0, SEEK_SET);
+	uint64_t rng = seed ^ 0x5bd1e995; // Not the generator's sequence
+	int ok = bench_check_cursor(te, &model);
+	int done = 0;
+	long total = 0;
+	editor_render(te);
+	while (ok && done < ops) {
+		int pick = bench_rand(&rng) % 100;
+		int op = 0;
+		while (pick >= bench_op_weights[op]) pick -= bench_op_weights[op++];
+		kinds[done] = op;
+		samples[done] = bench_step(&bl, &model, op, &rng);
+		total += samples[done++];
+		if (done % BENCH_CHECK_EVERY == 0) ok = bench_check_cursor(te, &model);
+	}
+	if (ok) ok = bench_check_all(te, &model);
+	long rss_end = bench_rss_bytes();
+	size_t mem_end = editor_memory_usage(te);
+
+	printf("  %-10s %9s %11s %9s %9s %9s %9s %9s\n", "op", "count", "ops/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	long* sorted = malloc(sizeof(long) * (done > 0 ? done : 1));
+	if (!sorted) {
+		perror("malloc");
+		exit(1);
+	}
+	for (int op = 0; op < BENCH_OP_COUNT; op++) {
+		int count = 0;
+		for (int i = 0; i < done; i++) {
+			if (kinds[i] == op) sorted[count++] = samples[i];
+		}
+		bench_report_op(bench_op_names[op], sorted, count);
+	}
+	memcpy(sorted, samples, sizeof(long) * done);
+	bench_report_op("all", sorted, done);
+	printf("  %d ops in %.2fs\n", done, total / 1e9);
+	printf("  memory: %.1f MB resident after loading (+%.1f MB), %.1f MB at the end with the reference model\n",
+		rss_loaded / 1048576.0, (rss_loaded - rss_start) / 1048576.0, rss_end / 1048576.0);
+	printf("  buffer: %.1f MB after loading, %.1f MB after the workload (%+.1f MB)\n",
+		mem_loaded / 1048576.0, mem_end / 1048576.0, ((long)mem_end - (long)mem_loaded) / 1048576.0);
+	if (ok) printf("  check: all %d lines match the reference model\n", model.count);
+	else printf("  check: FAILED after %d ops\n", done);
+
+	free(sorted);
+	free(samples);
+	free(kinds);
+	bench_model_free(&model);
+	close(te->out_fd);
+	if (te->journal) journal_close(te->journal, 1); // The workload's edits are not worth keeping
+	te->journal = NULL;
+	bl_free(&bl);
+	unlink(path);
+	return !ok;
+}
 
-    char *buffer = (char*)malloc((fileSize + 1) * sizeof(char));
-    if (buffer == NULL) {
-        perror("Error allocating memory");
-        fclose(file);
-        return NULL;
-    }
+// KIND is code, log, giant, tiny or all. Returns the exit status
+int bench_run(const char* kind_name, const char* size_text, int ops, long seed){
+	long size = bench_parse_size(size_text);
+	if (size <= 0) {
+		fprintf(stderr, "bench: bad size '%s'\n", size_text);
+		return 1;
+	}
+	if (size > BENCH_MAX_BYTES) {
+		fprintf(stderr, "bench: a buffer holds at most %ld MB, using that\n", BENCH_MAX_BYTES >> 20);
+		size = BENCH_MAX_BYTES;
+	}
 
-    // Read the file content into the buffer
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead != fileSize) {
-        perror("Error reading file");
-        free(buffer);
-        fclose(file);
-        return NULL;
-    }
+	int first = 0, last = BENCH_KIND_COUNT - 1;
+	if (strcmp(kind_name, "all") != 0) {
+		for (first = 0; first < BENCH_KIND_COUNT && strcmp(kind_name, bench_kind_names[first]) != 0; first++);
+		if (first == BENCH_KIND_COUNT) {
+			fprintf(stderr, "bench: unknown kind '%s', expected code, log, giant, tiny or all\n", kind_name);
+			return 1;
+		}
+		last = first;
+	}
 
-    buffer[fileSize] = '\0';
+	char dir[4096];
+	const char* tmp = getenv("TMPDIR");
+	snprintf(dir, sizeof(dir), "%s/editor-bench-XXXXXX", tmp ? tmp : "/tmp");
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
 
-    fclose(file);
-    return buffer;
+	int failed = 0;
+	for (int kind = first; kind <= last; kind++) {
+		failed |= bench_run_kind(kind, size, ops, (uint64_t)seed * 0x9e3779b97f4a7c15ULL + kind + 1, dir);
+	}
+	rmdir(dir);
+	return failed;
 }
 
 
+#ifndef gIgnoreHidden
+#define gIgnoreHidden 1
+#endif
+
 void exp_read_dir(){
     DIR* dirFile = opendir( "." );
     struct dirent* hFile;
@@ -908,25 +7357,112 @@ void exp_read_dir(){
 }
 
 
-int main() {
+int main(int argc, char** argv) {
 
-	struct termios original = enableRawMode(); 
-
-    TextEditor te;
-    editor_init(&te);
+	int fps = DEFAULT_FPS;
+	int server = 0;
+	int follow = 0;
+	const char* server_setting = NULL; // Given, but only a server started with it can apply it
+	char* bench_kind = NULL;
+	char* bench_size = NULL;
+	int bench_ops = 100000;
+	long bench_seed = 1;
+	char** filenames = malloc(sizeof(char*) * (argc + 1));
+	int file_args = 0;
 
     // char txt[] = "my name is elijah\n\t\tthis is really cool\n\tanother line without newline";
-	char* txt =  read_file_to_str("main.c");
-    editor_set_text(&te, txt, strlen(txt));
-	editor_set_cursor_to_first_line(&te);
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+			fps = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--server") == 0) {
+			server = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--follow") == 0) {
+			follow = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--intern") == 0) {
+			intern_lines = 1;
+			server_setting = "--intern";
+			continue;
+		}
+		if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) { // Megabytes
+			buffer_mem_budget = (size_t)atol(argv[++i]) << 20;
+			server_setting = "--budget";
+			continue;
+		}
+		if (strcmp(argv[i], "--bench") == 0 && i + 2 < argc) {
+			bench_kind = argv[++i];
+			bench_size = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+			bench_ops = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			bench_seed = atol(argv[++i]);
+			continue;
+		}
+		filenames[file_args++] = argv[i];
+	}
+	if (file_args == 0) {
+		filenames[file_args++] = "main.c";
+	}
+
+	if (bench_kind) {
+		free(filenames);
+		return bench_run(bench_kind, bench_size, bench_ops, bench_seed);
+	}
+
+	if (server) {
+		free(filenames);
+		return server_run(fps);
+	}
 
-	editor_render(&te); // Inital render of screen
-	editor_action_loop(&te);
+	// Attach to a running server when there is one
+	int server_fd = client_connect();
+	if (server_fd >= 0 && server_setting) {
+		fprintf(stderr, "%s cannot change the running server, restart it with --server %s\n",
+			server_setting, server_setting);
+		close(server_fd);
+		free(filenames);
+		return 1;
+	}
+	if (server_fd >= 0) {
+		struct termios original = enableRawMode();
+		client_run(server_fd, filenames, file_args, follow);
+		disableRawMode(&original);
+		free(filenames);
+		return 0;
+	}
+
+	struct termios original = enableRawMode(); 
+
+	BufferList bl;
+	bl_init(&bl);
+	for (int i = 0; i < file_args; i++) bl_open(&bl, filenames[i]);
+	for (int i = 0; follow && i < bl.count; i++) editor_toggle_follow(bl.buffers[i]);
+	free(filenames);
+	if (bl.count == 0) {
+		disableRawMode(&original);
+		return 1;
+	}
+
+	editor_render(bl_active(&bl)); // Inital render of screen
+	editor_action_loop(&bl, fps);
 
 
 
     write(STDOUT_FILENO, CLEAR_HOME, strlen(CLEAR_HOME));
-    editor_free(&te);
+	for (int i = 0; i < bl.count; i++) {
+		TextEditor* te = bl.buffers[i];
+		if (te->dirty && te->journal) fprintf(stderr, "Unsaved edits to %s kept, open it again to recover them\r\n", te->filename);
+	}
+    bl_free(&bl);
 	disableRawMode(&original);
 	return 0;
 }